@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "aes.h"
+
+// WinZip AES (AE-2): PBKDF2-HMAC-SHA1 key derivation, AES-CTR with a little
+// endian counter starting at 1, HMAC-SHA1 over the ciphertext truncated to
+// 10 bytes. See http://www.winzip.com/aes_info.htm
+
+ZSAesSecret *zs_aes_secret_new(const char *password) {
+	ZSAesSecret *secret;
+
+	if(password == NULL)
+		return NULL;
+
+	secret = (ZSAesSecret *)calloc(1, sizeof(ZSAesSecret));
+	if(secret == NULL)
+		return NULL;
+
+	secret->password = strdup(password);
+	if(secret->password == NULL) {
+		free(secret);
+
+		return NULL;
+	}
+
+	secret->len = strlen(password);
+
+	return secret;
+}
+
+void zs_aes_secret_free(ZSAesSecret *secret) {
+	if(secret == NULL)
+		return;
+
+	OPENSSL_cleanse(secret->password, secret->len);
+	free(secret->password);
+	free(secret);
+
+	return;
+}
+
+// A salt must never be used twice with the same password, every encryption
+// gets a new one
+int zs_aes_key_derive(ZSAesKey *key, const ZSAesSecret *secret) {
+	unsigned char derived[2 * ZS_AES_KEY_LENGTH + ZS_AES_VERIFIER_LENGTH];
+	int rv = -1;
+
+	if(RAND_bytes(key->salt, sizeof(key->salt)) != 1)
+		goto done;
+
+	if(PKCS5_PBKDF2_HMAC_SHA1(secret->password, secret->len, key->salt, sizeof(key->salt), ZS_AES_ITERATIONS, sizeof(derived), derived) != 1)
+		goto done;
+
+	memcpy(key->key, &derived[0], ZS_AES_KEY_LENGTH);
+	memcpy(key->mackey, &derived[ZS_AES_KEY_LENGTH], ZS_AES_KEY_LENGTH);
+	memcpy(key->verifier, &derived[2 * ZS_AES_KEY_LENGTH], ZS_AES_VERIFIER_LENGTH);
+
+	rv = 0;
+
+done:
+	OPENSSL_cleanse(derived, sizeof(derived));
+
+	return rv;
+}
+
+void zs_aes_key_clear(ZSAesKey *key) {
+	OPENSSL_cleanse(key, sizeof(ZSAesKey));
+
+	return;
+}
+
+int zs_aes_init(ZSAes *aes, const ZSAesKey *key) {
+	unsigned char pad[64];
+	int i;
+
+	memset(aes, 0, sizeof(ZSAes));
+
+	aes->cipher = EVP_CIPHER_CTX_new();
+	aes->mac = EVP_MD_CTX_new();
+	aes->macouter = EVP_MD_CTX_new();
+	if(aes->cipher == NULL || aes->mac == NULL || aes->macouter == NULL)
+		goto error;
+
+	// The counter blocks are encrypted in batches with ECB, such that
+	// AES-NI/VAES can pipeline many blocks per call
+	if(EVP_EncryptInit_ex(aes->cipher, EVP_aes_256_ecb(), NULL, key->key, NULL) != 1)
+		goto error;
+
+	EVP_CIPHER_CTX_set_padding(aes->cipher, 0);
+
+	// HMAC-SHA1, the key is shorter than the block size
+	memset(pad, 0x36, sizeof(pad));
+	for(i = 0; i < ZS_AES_KEY_LENGTH; i++)
+		pad[i] ^= key->mackey[i];
+
+	if(EVP_DigestInit_ex(aes->mac, EVP_sha1(), NULL) != 1 || EVP_DigestUpdate(aes->mac, pad, sizeof(pad)) != 1)
+		goto error;
+
+	memset(pad, 0x5c, sizeof(pad));
+	for(i = 0; i < ZS_AES_KEY_LENGTH; i++)
+		pad[i] ^= key->mackey[i];
+
+	if(EVP_DigestInit_ex(aes->macouter, EVP_sha1(), NULL) != 1 || EVP_DigestUpdate(aes->macouter, pad, sizeof(pad)) != 1)
+		goto error;
+
+	OPENSSL_cleanse(pad, sizeof(pad));
+
+	aes->keystream_pos = sizeof(aes->keystream);
+
+	return 0;
+
+error:
+	OPENSSL_cleanse(pad, sizeof(pad));
+	zs_aes_free(aes);
+
+	return -1;
+}
+
+static void zs_aes_keystream(ZSAes *aes) {
+	unsigned char *block;
+	int i, j, len;
+
+	for(i = 0; i < ZS_AES_BATCH; i++) {
+		// Little endian counter
+		for(j = 0; j < ZS_AES_BLOCK; j++) {
+			if(++aes->counter[j] != 0)
+				break;
+		}
+
+		block = &aes->keystream[i * ZS_AES_BLOCK];
+		memcpy(block, aes->counter, ZS_AES_BLOCK);
+	}
+
+	EVP_EncryptUpdate(aes->cipher, aes->keystream, &len, aes->keystream, sizeof(aes->keystream));
+
+	aes->keystream_pos = 0;
+
+	return;
+}
+
+void zs_aes_encrypt(ZSAes *aes, unsigned char *data, size_t len) {
+	unsigned char *p = data;
+	size_t n, i;
+	uint64_t a, b;
+
+	while(len != 0) {
+		if(aes->keystream_pos == sizeof(aes->keystream))
+			zs_aes_keystream(aes);
+
+		n = sizeof(aes->keystream) - aes->keystream_pos;
+		if(len < n)
+			n = len;
+
+		for(i = 0; i + 8 <= n; i += 8) {
+			memcpy(&a, &p[i], 8);
+			memcpy(&b, &aes->keystream[aes->keystream_pos + i], 8);
+			a ^= b;
+			memcpy(&p[i], &a, 8);
+		}
+
+		for(; i < n; i++)
+			p[i] ^= aes->keystream[aes->keystream_pos + i];
+
+		aes->keystream_pos += n;
+
+		p += n;
+		len -= n;
+	}
+
+	EVP_DigestUpdate(aes->mac, data, p - data);
+
+	return;
+}
+
+void zs_aes_finish(ZSAes *aes, unsigned char *mac) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len;
+
+	EVP_DigestFinal_ex(aes->mac, digest, &len);
+
+	EVP_DigestUpdate(aes->macouter, digest, len);
+	EVP_DigestFinal_ex(aes->macouter, digest, &len);
+
+	memcpy(mac, digest, ZS_AES_MAC_LENGTH);
+
+	return;
+}
+
+void zs_aes_free(ZSAes *aes) {
+	EVP_CIPHER_CTX_free(aes->cipher);
+	EVP_MD_CTX_free(aes->mac);
+	EVP_MD_CTX_free(aes->macouter);
+
+	OPENSSL_cleanse(aes, sizeof(ZSAes));
+
+	return;
+}
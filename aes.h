@@ -0,0 +1,54 @@
+#ifndef _AES_H_
+#define _AES_H_
+
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+#define ZS_AES_KEY_LENGTH		32	// AES-256
+#define ZS_AES_SALT_LENGTH		16
+#define ZS_AES_VERIFIER_LENGTH		2
+#define ZS_AES_MAC_LENGTH		10
+#define ZS_AES_ITERATIONS		1000
+
+#define ZS_AES_BLOCK			16
+#define ZS_AES_BATCH			256	// keystream blocks per cipher call
+
+// Password of an entry, kept by the plan
+typedef struct {
+	char *password;
+	size_t len;
+} ZSAesSecret;
+
+// Keys of one encryption, derived with a fresh salt by every reader
+typedef struct {
+	unsigned char salt[ZS_AES_SALT_LENGTH];
+	unsigned char verifier[ZS_AES_VERIFIER_LENGTH];
+	unsigned char key[ZS_AES_KEY_LENGTH];
+	unsigned char mackey[ZS_AES_KEY_LENGTH];
+} ZSAesKey;
+
+// Per reader encryption state
+typedef struct {
+	EVP_CIPHER_CTX *cipher;
+	EVP_MD_CTX *mac;
+	EVP_MD_CTX *macouter;
+
+	unsigned char counter[ZS_AES_BLOCK];
+
+	unsigned char keystream[ZS_AES_BATCH * ZS_AES_BLOCK];
+	size_t keystream_pos;
+} ZSAes;
+
+ZSAesSecret *zs_aes_secret_new(const char *password);
+void zs_aes_secret_free(ZSAesSecret *secret);
+
+int zs_aes_key_derive(ZSAesKey *key, const ZSAesSecret *secret);
+void zs_aes_key_clear(ZSAesKey *key);
+
+int zs_aes_init(ZSAes *aes, const ZSAesKey *key);
+void zs_aes_encrypt(ZSAes *aes, unsigned char *data, size_t len);
+void zs_aes_finish(ZSAes *aes, unsigned char *mac);
+void zs_aes_free(ZSAes *aes);
+
+#endif
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "zipstream.h"
+#include "broadcast.h"
+
+ZSBroadcast *zs_broadcast_new(ZSPlan *zsp, size_t budget, int spill) {
+	ZSBroadcast *zb;
+	FILE *fp;
+
+	if(zsp == NULL)
+		return NULL;
+
+	zb = (ZSBroadcast *)calloc(1, sizeof(ZSBroadcast));
+	if(zb == NULL)
+		return NULL;
+
+	zb->fd = -1;
+
+	if(spill != 0) {
+		fp = tmpfile();
+		if(fp == NULL) {
+			free(zb);
+
+			return NULL;
+		}
+
+		zb->fd = dup(fileno(fp));
+		fclose(fp);
+
+		if(zb->fd == -1) {
+			free(zb);
+
+			return NULL;
+		}
+	}
+
+	if(zs_open(&zb->zs, zsp) != 0) {
+		if(zb->fd != -1)
+			close(zb->fd);
+
+		free(zb);
+
+		return NULL;
+	}
+
+	zb->budget = budget;
+	zb->refs = 1;
+
+	pthread_mutex_init(&zb->lock, NULL);
+	pthread_cond_init(&zb->cond, NULL);
+
+	return zb;
+}
+
+void zs_broadcast_unref(ZSBroadcast *zb) {
+	size_t i;
+	int refs;
+
+	if(zb == NULL)
+		return;
+
+	pthread_mutex_lock(&zb->lock);
+	refs = --zb->refs;
+	pthread_mutex_unlock(&zb->lock);
+
+	if(refs != 0)
+		return;
+
+	zs_free(&zb->zs);
+
+	for(i = 0; i < zb->nchunks; i++)
+		free(zb->chunks[i]);
+
+	free(zb->chunks);
+
+	if(zb->fd != -1)
+		close(zb->fd);
+
+	pthread_mutex_destroy(&zb->lock);
+	pthread_cond_destroy(&zb->cond);
+
+	free(zb);
+
+	return;
+}
+
+// A new reader starts at the beginning of the archive, which must still be
+// in memory or spilled
+ZSBroadcastReader *zs_broadcast_open(ZSBroadcast *zb) {
+	ZSBroadcastReader *zr;
+
+	if(zb == NULL)
+		return NULL;
+
+	zr = (ZSBroadcastReader *)calloc(1, sizeof(ZSBroadcastReader));
+	if(zr == NULL)
+		return NULL;
+
+	zr->zb = zb;
+
+	pthread_mutex_lock(&zb->lock);
+
+	if(zb->first != 0 && zb->fd == -1) {
+		pthread_mutex_unlock(&zb->lock);
+
+		free(zr);
+
+		return NULL;
+	}
+
+	zr->next = zb->readers;
+	zb->readers = zr;
+
+	zb->refs++;
+
+	pthread_mutex_unlock(&zb->lock);
+
+	return zr;
+}
+
+void zs_broadcast_close(ZSBroadcastReader *zr) {
+	ZSBroadcast *zb;
+	ZSBroadcastReader **pzr;
+
+	if(zr == NULL)
+		return;
+
+	zb = zr->zb;
+
+	pthread_mutex_lock(&zb->lock);
+
+	for(pzr = &zb->readers; *pzr != NULL; pzr = &(*pzr)->next) {
+		if(*pzr == zr) {
+			*pzr = zr->next;
+			break;
+		}
+	}
+
+	// The producer may have waited for this one
+	pthread_cond_broadcast(&zb->cond);
+
+	pthread_mutex_unlock(&zb->lock);
+
+	free(zr);
+
+	zs_broadcast_unref(zb);
+
+	return;
+}
+
+static int zs_broadcast_pwrite(int fd, const char *data, size_t len, size_t pos) {
+	size_t bytes;
+	ssize_t n;
+
+	for(bytes = 0; bytes < len; bytes += n) {
+		n = pwrite(fd, &data[bytes], len - bytes, pos + bytes);
+		if(n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int zs_broadcast_pread(int fd, char *data, size_t len, size_t pos) {
+	size_t bytes;
+	ssize_t n;
+
+	for(bytes = 0; bytes < len; bytes += n) {
+		n = pread(fd, &data[bytes], len - bytes, pos + bytes);
+		if(n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Make room for another chunk. Full chunks are spilled, or without a spill
+// file dropped if every reader is past them. Called by the producer with the
+// lock held.
+static int zs_broadcast_evict(ZSBroadcast *zb) {
+	ZSBroadcastReader *zr;
+	size_t limit, i;
+	char *data;
+	int rv;
+
+	if(zb->budget == 0)
+		return 0;
+
+	limit = zb->size / ZS_BROADCAST_CHUNK;
+
+	if(zb->fd == -1) {
+		for(zr = zb->readers; zr != NULL; zr = zr->next) {
+			if(zr->pos / ZS_BROADCAST_CHUNK < limit)
+				limit = zr->pos / ZS_BROADCAST_CHUNK;
+		}
+	}
+
+	while(zb->memory + ZS_BROADCAST_CHUNK > zb->budget && zb->first < limit) {
+		i = zb->first;
+		data = zb->chunks[i];
+
+		// Readers keep copying from memory meanwhile
+		if(zb->fd != -1) {
+			pthread_mutex_unlock(&zb->lock);
+			rv = zs_broadcast_pwrite(zb->fd, data, ZS_BROADCAST_CHUNK, i * ZS_BROADCAST_CHUNK);
+			pthread_mutex_lock(&zb->lock);
+
+			if(rv != 0)
+				return -1;
+		}
+
+		zb->chunks[i] = NULL;
+		zb->first++;
+		zb->memory -= ZS_BROADCAST_CHUNK;
+
+		free(data);
+	}
+
+	return 0;
+}
+
+// Append the next piece of the archive, called with the lock held. Returns
+// ZSE_AGAIN if the codec budget is exhausted, 1 if it would have to wait for
+// the slowest reader and wait is 0.
+static int zs_broadcast_produce(ZSBroadcast *zb, int wait) {
+	char **chunks, *data;
+	size_t off;
+	int n;
+
+	zb->producing = 1;
+
+	if(zb->size == zb->nchunks * ZS_BROADCAST_CHUNK) {
+		if(zs_broadcast_evict(zb) != 0)
+			goto error;
+
+		// Wait for the slowest reader, a single chunk is always allowed
+		if(zb->budget != 0 && zb->memory != 0 && zb->memory + ZS_BROADCAST_CHUNK > zb->budget) {
+			zb->producing = 0;
+
+			if(wait == 0)
+				return 1;
+
+			pthread_cond_wait(&zb->cond, &zb->lock);
+
+			return 0;
+		}
+
+		if(zb->nchunks == zb->schunks) {
+			chunks = (char **)realloc(zb->chunks, (zb->schunks + 64) * sizeof(char *));
+			if(chunks == NULL)
+				goto error;
+
+			zb->chunks = chunks;
+			zb->schunks += 64;
+		}
+
+		data = (char *)malloc(ZS_BROADCAST_CHUNK);
+		if(data == NULL)
+			goto error;
+
+		zb->chunks[zb->nchunks++] = data;
+		zb->memory += ZS_BROADCAST_CHUNK;
+	}
+
+	data = zb->chunks[zb->nchunks - 1];
+	off = zb->size % ZS_BROADCAST_CHUNK;
+
+	// Readers only look below size
+	pthread_mutex_unlock(&zb->lock);
+	n = zs_read(&zb->zs, &data[off], ZS_BROADCAST_CHUNK - off);
+	pthread_mutex_lock(&zb->lock);
+
+	zb->producing = 0;
+	pthread_cond_broadcast(&zb->cond);
+
+	if(n == ZSE_AGAIN)
+		return ZSE_AGAIN;
+
+	if(n < 0) {
+		zb->error = 1;
+
+		return -1;
+	}
+
+	zb->size += n;
+
+	if(zb->zs.stage == FIN)
+		zb->done = 1;
+
+	return 0;
+
+error:
+	zb->producing = 0;
+	zb->error = 1;
+
+	pthread_cond_broadcast(&zb->cond);
+
+	return -1;
+}
+
+// Like zs_read(): fills buf unless the end of the archive is reached, but
+// returns early rather than wait for another reader that is producing or, at
+// the budget without a spill file, for the slowest reader. A call that has
+// nothing to return yet waits for either.
+int zs_broadcast_read(ZSBroadcastReader *zr, char *buf, int sbuf) {
+	ZSBroadcast *zb;
+	size_t i, off, n;
+	int bytes, rv;
+
+	if(zr == NULL || buf == NULL || sbuf < 0)
+		return -1;
+
+	zb = zr->zb;
+	bytes = 0;
+
+	pthread_mutex_lock(&zb->lock);
+
+	while(bytes < sbuf) {
+		if(zb->error == 1) {
+			bytes = -1;
+			break;
+		}
+
+		if(zr->pos < zb->size) {
+			i = zr->pos / ZS_BROADCAST_CHUNK;
+			off = zr->pos % ZS_BROADCAST_CHUNK;
+
+			n = ZS_BROADCAST_CHUNK - off;
+			if(zb->size - zr->pos < n)
+				n = zb->size - zr->pos;
+			if((size_t)(sbuf - bytes) < n)
+				n = sbuf - bytes;
+
+			if(zb->chunks[i] != NULL)
+				memcpy(&buf[bytes], &zb->chunks[i][off], n);
+			else if(zb->fd != -1) {
+				// Spilled chunks don't change any more
+				pthread_mutex_unlock(&zb->lock);
+				rv = zs_broadcast_pread(zb->fd, &buf[bytes], n, zr->pos);
+				pthread_mutex_lock(&zb->lock);
+
+				if(rv != 0) {
+					bytes = -1;
+					break;
+				}
+			}
+			else {
+				bytes = -1;
+				break;
+			}
+
+			zr->pos += n;
+			bytes += n;
+
+			// The chunk may be dropped now
+			if(zr->pos % ZS_BROADCAST_CHUNK == 0)
+				pthread_cond_broadcast(&zb->cond);
+
+			continue;
+		}
+
+		if(zb->done == 1)
+			break;
+
+		if(zb->producing == 1) {
+			if(bytes != 0)
+				break;
+
+			pthread_cond_wait(&zb->cond, &zb->lock);
+			continue;
+		}
+
+		rv = zs_broadcast_produce(zb, bytes == 0);
+		if(rv == 1)
+			break;
+
+		if(rv == ZSE_AGAIN) {
+			if(bytes == 0)
+				bytes = ZSE_AGAIN;
+			break;
+		}
+
+		if(rv != 0) {
+			bytes = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&zb->lock);
+
+	return bytes;
+}
@@ -0,0 +1,63 @@
+#ifndef _BROADCAST_H_
+#define _BROADCAST_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "zipstream.h"
+
+#define ZS_BROADCAST_CHUNK	262144
+
+struct ZSBroadcast;
+
+// One client of a broadcast
+typedef struct ZSBroadcastReader {
+	struct ZSBroadcast *zb;
+
+	size_t pos;
+
+	struct ZSBroadcastReader *next;
+} ZSBroadcastReader;
+
+// One archive generation shared by any number of readers. The reader at the
+// head produces the next chunk with zs_read(), the others copy what is
+// already there. Chunks are kept in memory up to a budget, older ones are
+// spilled to an unlinked temporary file or, without spilling, dropped once
+// every reader is past them.
+typedef struct ZSBroadcast {
+	int refs;
+
+	// Producer
+	ZS zs;
+	int producing;
+	int done;
+	int error;
+
+	// Bytes produced so far
+	size_t size;
+
+	// Chunks, NULL once spilled or dropped
+	char **chunks;
+	size_t nchunks;
+	size_t schunks;
+	size_t first;	// oldest chunk in memory
+
+	size_t memory;
+	size_t budget;	// 0: unlimited
+
+	int fd;		// spill file, -1: none
+
+	ZSBroadcastReader *readers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} ZSBroadcast;
+
+ZSBroadcast *zs_broadcast_new(ZSPlan *zsp, size_t budget, int spill);
+void zs_broadcast_unref(ZSBroadcast *zb);
+
+ZSBroadcastReader *zs_broadcast_open(ZSBroadcast *zb);
+int zs_broadcast_read(ZSBroadcastReader *zr, char *buf, int sbuf);
+void zs_broadcast_close(ZSBroadcastReader *zr);
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "zipstream.h"
+#include "codec.h"
+
+#ifdef WITH_BZIP2
+// The bzip2 library has no reset, its allocations are kept in the context
+// and handed out again when the next stream is initialised
+static void *zs_codec_bzalloc(void *opaque, int items, int size) {
+	ZSCodec *codec = (ZSCodec *)opaque;
+	size_t n = (size_t)items * size;
+	int i, slot = -1;
+
+	for(i = 0; i < ZS_CODEC_BLOCKS; i++) {
+		if(codec->blocks[i].used == 1)
+			continue;
+
+		if(codec->blocks[i].data != NULL && codec->blocks[i].size == n) {
+			codec->blocks[i].used = 1;
+
+			return codec->blocks[i].data;
+		}
+
+		if(slot == -1 || codec->blocks[slot].data != NULL)
+			slot = i;
+	}
+
+	if(slot == -1)
+		return malloc(n);
+
+	free(codec->blocks[slot].data);
+
+	codec->blocks[slot].data = malloc(n);
+	if(codec->blocks[slot].data == NULL)
+		return NULL;
+
+	codec->blocks[slot].size = n;
+	codec->blocks[slot].used = 1;
+
+	return codec->blocks[slot].data;
+}
+
+static void zs_codec_bzfree(void *opaque, void *p) {
+	ZSCodec *codec = (ZSCodec *)opaque;
+	int i;
+
+	for(i = 0; i < ZS_CODEC_BLOCKS; i++) {
+		if(codec->blocks[i].data == p) {
+			codec->blocks[i].used = 0;
+
+			return;
+		}
+	}
+
+	free(p);
+
+	return;
+}
+#endif
+
+static size_t zs_codec_memory(int method, int level) {
+	switch(method) {
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			return ZS_CODEC_MEMORY_DEFLATE;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			return ZS_CODEC_MEMORY_BZIP2(level);
+#endif
+		default:
+			break;
+	}
+
+#ifndef WITH_BZIP2
+	(void)level;
+#endif
+
+	return 0;
+}
+
+ZSCodec *zs_codec_new(int method, int level) {
+	ZSCodec *codec;
+	int rv = -1;
+
+	codec = (ZSCodec *)calloc(1, sizeof(ZSCodec));
+	if(codec == NULL)
+		return NULL;
+
+	codec->method = method;
+	codec->level = level;
+	codec->memory = zs_codec_memory(method, level);
+
+	switch(method) {
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			codec->deflate.zalloc = Z_NULL;
+			codec->deflate.zfree = Z_NULL;
+			codec->deflate.opaque = Z_NULL;
+
+			if(deflateInit2(&codec->deflate, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+				rv = 0;
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			codec->bzip2.bzalloc = zs_codec_bzalloc;
+			codec->bzip2.bzfree = zs_codec_bzfree;
+			codec->bzip2.opaque = codec;
+
+			if(BZ2_bzCompressInit(&codec->bzip2, level, 0, 30) == BZ_OK) {
+				codec->init = 1;
+				rv = 0;
+			}
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if(rv != 0) {
+		zs_codec_free(codec);
+
+		return NULL;
+	}
+
+	return codec;
+}
+
+// Prepare the context for a new stream
+int zs_codec_reset(ZSCodec *codec, int level) {
+	switch(codec->method) {
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			if(deflateReset(&codec->deflate) != Z_OK)
+				return -1;
+
+			if(level != codec->level && deflateParams(&codec->deflate, level, Z_DEFAULT_STRATEGY) != Z_OK)
+				return -1;
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			if(codec->init == 1)
+				BZ2_bzCompressEnd(&codec->bzip2);
+
+			codec->init = 0;
+
+			if(BZ2_bzCompressInit(&codec->bzip2, level, 0, 30) != BZ_OK)
+				return -1;
+
+			codec->init = 1;
+			break;
+#endif
+		default:
+			return -1;
+	}
+
+	codec->level = level;
+	codec->memory = zs_codec_memory(codec->method, level);
+
+	return 0;
+}
+
+void zs_codec_free(ZSCodec *codec) {
+#ifdef WITH_BZIP2
+	int i;
+#endif
+
+	if(codec == NULL)
+		return;
+
+	switch(codec->method) {
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			deflateEnd(&codec->deflate);
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			if(codec->init == 1)
+				BZ2_bzCompressEnd(&codec->bzip2);
+
+			for(i = 0; i < ZS_CODEC_BLOCKS; i++)
+				free(codec->blocks[i].data);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	free(codec);
+
+	return;
+}
+
+ZSCodecPool *zs_codec_pool_new(size_t budget, int wait) {
+	ZSCodecPool *zcp;
+
+	zcp = (ZSCodecPool *)calloc(1, sizeof(ZSCodecPool));
+	if(zcp == NULL)
+		return NULL;
+
+	zcp->budget = budget;
+	zcp->wait = wait;
+
+	pthread_mutex_init(&zcp->lock, NULL);
+	pthread_cond_init(&zcp->cond, NULL);
+
+	return zcp;
+}
+
+// Whether memory more bytes fit into the budget after release bytes are
+// given back. A single context always fits, even if it exceeds the budget.
+static int zs_codec_fits(ZSCodecPool *zcp, size_t release, size_t memory) {
+	size_t total = zcp->memory - release;
+
+	return (zcp->budget == 0 || total == 0 || total + memory <= zcp->budget);
+}
+
+// Hand out a context for method and level. Returns 1 if the budget is
+// exhausted and the pool doesn't wait, -1 on error.
+int zs_codec_get(ZSCodecPool *zcp, int method, int level, ZSCodec **codec) {
+	ZSCodec *c, **pc, **match;
+	size_t memory;
+
+	*codec = NULL;
+
+	memory = zs_codec_memory(method, level);
+	if(memory == 0)
+		return -1;
+
+	pthread_mutex_lock(&zcp->lock);
+
+	for(;;) {
+		// Prefer an idle context with the same level
+		match = NULL;
+
+		for(pc = &zcp->idle; *pc != NULL; pc = &(*pc)->next) {
+			if((*pc)->method != method)
+				continue;
+
+			if(match == NULL || (*pc)->level == level)
+				match = pc;
+
+			if((*pc)->level == level)
+				break;
+		}
+
+		if(match != NULL && zs_codec_fits(zcp, (*match)->memory, memory)) {
+			c = *match;
+			*match = c->next;
+
+			zcp->memory -= c->memory;
+			zcp->memory += memory;
+
+			pthread_mutex_unlock(&zcp->lock);
+
+			c->next = NULL;
+
+			if(zs_codec_reset(c, level) != 0) {
+				pthread_mutex_lock(&zcp->lock);
+				zcp->memory -= memory;
+				pthread_cond_broadcast(&zcp->cond);
+				pthread_mutex_unlock(&zcp->lock);
+
+				zs_codec_free(c);
+
+				return -1;
+			}
+
+			*codec = c;
+
+			return 0;
+		}
+
+		if(zs_codec_fits(zcp, 0, memory)) {
+			zcp->memory += memory;
+
+			pthread_mutex_unlock(&zcp->lock);
+
+			c = zs_codec_new(method, level);
+			if(c == NULL) {
+				pthread_mutex_lock(&zcp->lock);
+				zcp->memory -= memory;
+				pthread_cond_broadcast(&zcp->cond);
+				pthread_mutex_unlock(&zcp->lock);
+
+				return -1;
+			}
+
+			*codec = c;
+
+			return 0;
+		}
+
+		// Make room by dropping idle contexts
+		if(zcp->idle != NULL) {
+			c = zcp->idle;
+			zcp->idle = c->next;
+
+			zcp->memory -= c->memory;
+
+			pthread_mutex_unlock(&zcp->lock);
+			zs_codec_free(c);
+			pthread_mutex_lock(&zcp->lock);
+
+			continue;
+		}
+
+		if(zcp->wait == 0) {
+			pthread_mutex_unlock(&zcp->lock);
+
+			return 1;
+		}
+
+		pthread_cond_wait(&zcp->cond, &zcp->lock);
+	}
+}
+
+void zs_codec_put(ZSCodecPool *zcp, ZSCodec *codec) {
+	if(codec == NULL)
+		return;
+
+	pthread_mutex_lock(&zcp->lock);
+
+	codec->next = zcp->idle;
+	zcp->idle = codec;
+
+	pthread_cond_broadcast(&zcp->cond);
+
+	pthread_mutex_unlock(&zcp->lock);
+
+	return;
+}
+
+// All contexts must have been put back
+void zs_codec_pool_free(ZSCodecPool *zcp) {
+	ZSCodec *codec;
+
+	if(zcp == NULL)
+		return;
+
+	while(zcp->idle != NULL) {
+		codec = zcp->idle;
+		zcp->idle = codec->next;
+
+		zs_codec_free(codec);
+	}
+
+	pthread_mutex_destroy(&zcp->lock);
+	pthread_cond_destroy(&zcp->cond);
+
+	free(zcp);
+
+	return;
+}
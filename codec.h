@@ -0,0 +1,69 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef WITH_DEFLATE
+	#include <zlib.h>
+#endif
+#ifdef WITH_BZIP2
+	#include <bzlib.h>
+#endif
+
+// Memory of a compressor context, see zconf.h and the bzip2 manual
+#define ZS_CODEC_MEMORY_DEFLATE		((1 << 17) + (1 << 17) + 6 * 1024)
+#define ZS_CODEC_MEMORY_BZIP2(level)	((400 + 800 * (level)) * 1024)
+
+// Allocations of the bzip2 library that are kept across streams
+#define ZS_CODEC_BLOCKS			8
+
+// Compressor context, reset rather than re-initialised between streams
+typedef struct ZSCodec {
+	int method;
+	int level;
+	size_t memory;
+
+#ifdef WITH_DEFLATE
+	z_stream deflate;
+#endif
+
+#ifdef WITH_BZIP2
+	bz_stream bzip2;
+	int init;
+
+	struct {
+		void *data;
+		size_t size;
+		int used;
+	} blocks[ZS_CODEC_BLOCKS];
+#endif
+
+	struct ZSCodec *next;
+} ZSCodec;
+
+// Idle compressor contexts shared by any number of streams, with a ceiling
+// on the memory of all contexts, idle or in use
+typedef struct ZSCodecPool {
+	size_t budget;	// 0: unlimited
+	size_t memory;
+
+	// Wait for a context instead of reporting the budget as exhausted
+	int wait;
+
+	ZSCodec *idle;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} ZSCodecPool;
+
+ZSCodec *zs_codec_new(int method, int level);
+int zs_codec_reset(ZSCodec *codec, int level);
+void zs_codec_free(ZSCodec *codec);
+
+ZSCodecPool *zs_codec_pool_new(size_t budget, int wait);
+int zs_codec_get(ZSCodecPool *zcp, int method, int level, ZSCodec **codec);
+void zs_codec_put(ZSCodecPool *zcp, ZSCodec *codec);
+void zs_codec_pool_free(ZSCodecPool *zcp);
+
+#endif
@@ -1,3 +1,8 @@
+#include <stdint.h>
+#include <pthread.h>
+
+#include "crc32.h"
+
 unsigned long crclookup[256] = {
 0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
@@ -33,7 +38,45 @@ unsigned long crclookup[256] = {
 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
+// Slicing-by-8 tables, derived from crclookup on first use
+static uint32_t crcslice[8][256];
+static pthread_once_t crcslice_once = PTHREAD_ONCE_INIT;
+
+static void crc_init_slices(void) {
+	int i, k;
+
+	for(i = 0; i < 256; i++)
+		crcslice[0][i] = crclookup[i];
+
+	for(k = 1; k < 8; k++) {
+		for(i = 0; i < 256; i++)
+			crcslice[k][i] = (crcslice[k - 1][i] >> 8) ^ crclookup[crcslice[k - 1][i] & 0xFF];
+	}
+
+	return;
+}
+
 unsigned long crc_partial(unsigned long crc, const unsigned char *data, unsigned long len) {
+	uint32_t lo, hi;
+
+	pthread_once(&crcslice_once, crc_init_slices);
+
+	while(len != 0 && ((uintptr_t)data & 7) != 0) {
+		crc = (crc >> 8) ^ crclookup[(crc & 0xFF) ^ *data++];
+		len--;
+	}
+
+	while(len >= 8) {
+		lo = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+		hi = (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+
+		crc = crcslice[7][lo & 0xFF] ^ crcslice[6][(lo >> 8) & 0xFF] ^ crcslice[5][(lo >> 16) & 0xFF] ^ crcslice[4][lo >> 24]
+		    ^ crcslice[3][hi & 0xFF] ^ crcslice[2][(hi >> 8) & 0xFF] ^ crcslice[1][(hi >> 16) & 0xFF] ^ crcslice[0][hi >> 24];
+
+		data += 8;
+		len -= 8;
+	}
+
 	while(len--)
 		crc = (crc >> 8) ^ crclookup[(crc & 0xFF) ^ *data++];
 
@@ -47,3 +90,50 @@ unsigned long crc_start(void) {
 unsigned long crc_finish(unsigned long crc) {
 	return (crc ^ 0xFFFFFFFF);
 }
+
+// a * b modulo the CRC polynomial, reflected
+static unsigned long crc_multmodp(unsigned long a, unsigned long b) {
+	unsigned long m, p;
+
+	m = 1UL << 31;
+	p = 0;
+
+	for(;;) {
+		if(a & m) {
+			p ^= b;
+
+			if((a & (m - 1)) == 0)
+				break;
+		}
+
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+
+	return p;
+}
+
+// CRC32 of A followed by B from the (finished) CRC32 of A, the CRC32 of B
+// and the length of B
+unsigned long crc_combine(unsigned long crc1, unsigned long crc2, size_t len2) {
+	unsigned long p, x;
+	int i;
+
+	// x^(2^3), one byte
+	x = 1UL << 30;
+	for(i = 0; i < 3; i++)
+		x = crc_multmodp(x, x);
+
+	// x^(8 * len2)
+	p = 1UL << 31;
+
+	while(len2 != 0) {
+		if(len2 & 1)
+			p = crc_multmodp(x, p);
+
+		len2 >>= 1;
+		x = crc_multmodp(x, x);
+	}
+
+	return crc_multmodp(p, crc1) ^ crc2;
+}
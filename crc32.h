@@ -1,8 +1,11 @@
 #ifndef _CRC32_H_
 #define _CRC32_H_
 
+#include <stddef.h>
+
 unsigned long crc_partial(unsigned long crc, const unsigned char *data, unsigned long len);
 unsigned long crc_start(void);
 unsigned long crc_finish(unsigned long crc);
+unsigned long crc_combine(unsigned long crc1, unsigned long crc2, size_t len2);
 
 #endif
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zipstream.h"
+#include "zip.h"
+#include "dedup.h"
+
+#define ZS_DEDUP_TABLE_MIN	1024
+
+static size_t zs_dedup_key(size_t a, size_t b, ZSFile *zsf) {
+	size_t key;
+
+	key = a * 0x9E3779B97F4A7C15ULL;
+	key ^= b + 0x9E3779B97F4A7C15ULL + (key << 6) + (key >> 2);
+	key ^= ((size_t)zsf->compression << 8) | (size_t)(zsf->level & 0xFF);
+
+	return key;
+}
+
+static int zs_dedup_grow(ZSDedupTable *t) {
+	ZSDedupNode **buckets, *node;
+	size_t size, i;
+
+	size = (t->size == 0) ? ZS_DEDUP_TABLE_MIN : 2 * t->size;
+
+	buckets = (ZSDedupNode **)calloc(size, sizeof(ZSDedupNode *));
+	if(buckets == NULL)
+		return -1;
+
+	for(i = 0; i < t->size; i++) {
+		while(t->buckets[i] != NULL) {
+			node = t->buckets[i];
+			t->buckets[i] = node->next;
+
+			node->next = buckets[node->key & (size - 1)];
+			buckets[node->key & (size - 1)] = node;
+		}
+	}
+
+	free(t->buckets);
+
+	t->buckets = buckets;
+	t->size = size;
+
+	return 0;
+}
+
+static int zs_dedup_insert(ZSDedupTable *t, size_t key, ZSFile *zsf) {
+	ZSDedupNode *node;
+
+	if(t->count >= t->size && zs_dedup_grow(t) != 0)
+		return -1;
+
+	node = (ZSDedupNode *)calloc(1, sizeof(ZSDedupNode));
+	if(node == NULL)
+		return -1;
+
+	node->key = key;
+	node->zsf = zsf;
+
+	node->next = t->buckets[key & (t->size - 1)];
+	t->buckets[key & (t->size - 1)] = node;
+
+	t->count++;
+
+	return 0;
+}
+
+static ZSDedupNode *zs_dedup_bucket(ZSDedupTable *t, size_t key) {
+	if(t->size == 0)
+		return NULL;
+
+	return t->buckets[key & (t->size - 1)];
+}
+
+static void zs_dedup_table_free(ZSDedupTable *t) {
+	ZSDedupNode *node;
+	size_t i;
+
+	for(i = 0; i < t->size; i++) {
+		while(t->buckets[i] != NULL) {
+			node = t->buckets[i];
+			t->buckets[i] = node->next;
+
+			free(node);
+		}
+	}
+
+	free(t->buckets);
+
+	memset(t, 0, sizeof(ZSDedupTable));
+
+	return;
+}
+
+// Whether both entries are compressed the same way
+static int zs_dedup_alike(ZSFile *a, ZSFile *b) {
+	return (a->compression == b->compression && a->level == b->level && a->fsize == b->fsize);
+}
+
+static int zs_dedup_hash(const char *path, unsigned long *crc) {
+	size_t size;
+
+	return (zs_crc_file(NULL, path, crc, &size) == 0) ? 1 : -1;
+}
+
+// Byte for byte, a CRC32 match alone isn't proof
+static int zs_dedup_equal(const char *a, const char *b) {
+	FILE *fa, *fb;
+	char bufa[ZS_COMPRESS_BUFFER_DEFLATE * 4], bufb[ZS_COMPRESS_BUFFER_DEFLATE * 4];
+	size_t na, nb;
+	int equal = 0;
+
+	fa = fopen(a, "rb");
+	fb = fopen(b, "rb");
+
+	if(fa != NULL && fb != NULL) {
+		do {
+			na = fread(bufa, 1, sizeof(bufa), fa);
+			nb = fread(bufb, 1, sizeof(bufb), fb);
+
+			if(na != nb || memcmp(bufa, bufb, na) != 0)
+				break;
+		} while(na != 0);
+
+		equal = (na == 0 && nb == 0 && !ferror(fa) && !ferror(fb));
+	}
+
+	if(fa != NULL)
+		fclose(fa);
+	if(fb != NULL)
+		fclose(fb);
+
+	return equal;
+}
+
+// Put zsf into the group of an earlier identical entry, or remember it as the
+// first of its kind. Only compressed, unencrypted files take part.
+int zs_dedup_add(ZSDedup *dd, ZSFile *zsf) {
+	ZSDedupNode *node;
+	ZSFile *first = NULL;
+	unsigned long crc = 0;
+	size_t ikey, skey;
+	int hashed = 0;
+
+	if(zsf->compression == ZS_COMPRESS_NONE || zsf->compression == ZS_COMPRESS_RAW || zsf->fsize == 0)
+		return 0;
+
+	// Small files are compressed in one go anyway
+	if(!(zsf->flags & ZS_FLAG_DESCRIPTOR))
+		return 0;
+
+#ifdef WITH_AES
+	if(zsf->aes != NULL)
+		return 0;
+#endif
+
+	ikey = zs_dedup_key(zsf->dev, zsf->ino, zsf);
+	skey = zs_dedup_key(zsf->fsize, 0, zsf);
+
+	// Hard links and the same file added twice
+	for(node = zs_dedup_bucket(&dd->inodes, ikey); node != NULL && first == NULL; node = node->next) {
+		if(node->zsf->dev == zsf->dev && node->zsf->ino == zsf->ino && zs_dedup_alike(node->zsf, zsf))
+			first = node->zsf;
+	}
+
+	// Copies, files are only read if another one has the same size
+	if(dd->mode & ZS_DEDUP_CONTENT) {
+		for(node = zs_dedup_bucket(&dd->sizes, skey); node != NULL && first == NULL; node = node->next) {
+			if(!zs_dedup_alike(node->zsf, zsf))
+				continue;
+
+			if(node->hashed == 0)
+				node->hashed = zs_dedup_hash(node->zsf->fpath, &node->crc32);
+
+			if(hashed == 0)
+				hashed = zs_dedup_hash(zsf->fpath, &crc);
+
+			if(node->hashed == 1 && hashed == 1 && node->crc32 == crc && zs_dedup_equal(node->zsf->fpath, zsf->fpath))
+				first = node->zsf;
+		}
+	}
+
+	if(first != NULL) {
+		if(first->dedup == 0)
+			first->dedup = ++dd->groups;
+
+		zsf->dedup = first->dedup;
+
+		return 0;
+	}
+
+	if((dd->mode & ZS_DEDUP_INODE) && zs_dedup_insert(&dd->inodes, ikey, zsf) != 0)
+		return -1;
+
+	if(dd->mode & ZS_DEDUP_CONTENT) {
+		if(zs_dedup_insert(&dd->sizes, skey, zsf) != 0)
+			return -1;
+
+		if(hashed != 0) {
+			dd->sizes.buckets[skey & (dd->sizes.size - 1)]->crc32 = crc;
+			dd->sizes.buckets[skey & (dd->sizes.size - 1)]->hashed = hashed;
+		}
+	}
+
+	return 0;
+}
+
+// Drop the tables, the group numbers stay with the entries
+void zs_dedup_free(ZSDedup *dd) {
+	zs_dedup_table_free(&dd->inodes);
+	zs_dedup_table_free(&dd->sizes);
+
+	return;
+}
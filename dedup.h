@@ -0,0 +1,71 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stddef.h>
+
+#ifdef WITH_DIGEST
+	#include "digest.h"
+#endif
+
+// Detection modes
+#define ZS_DEDUP_INODE		0x01	// same device and inode
+#define ZS_DEDUP_CONTENT	0x02	// same size, CRC32 and bytes
+#define ZS_DEDUP_SPILL		0x04	// keep the replayed output in a temporary file
+
+// Slot states
+#define ZS_DEDUP_EMPTY		0
+#define ZS_DEDUP_CAPTURE	1
+#define ZS_DEDUP_READY		2
+#define ZS_DEDUP_FAILED		3
+
+struct ZSFile;
+
+typedef struct ZSDedupNode {
+	size_t key;
+	struct ZSFile *zsf;
+
+	// CRC32 of the file, computed when another file of the same size shows up
+	unsigned long crc32;
+	int hashed;	// 0: not yet, 1: done, -1: unreadable
+
+	struct ZSDedupNode *next;
+} ZSDedupNode;
+
+typedef struct {
+	size_t size;
+	size_t count;
+	ZSDedupNode **buckets;
+} ZSDedupTable;
+
+// First occurrences of the entries added so far, by inode and by size.
+// Dropped when the plan is finalized, only the group numbers remain.
+typedef struct {
+	int mode;
+	size_t budget;	// 0: unlimited
+
+	// Groups of identical entries, numbered from 1
+	int groups;
+
+	ZSDedupTable inodes;
+	ZSDedupTable sizes;
+} ZSDedup;
+
+// Output of the first entry of a group, as captured by a cursor
+typedef struct {
+	int state;
+
+	size_t pos;
+	size_t len;
+
+	unsigned long crc32;
+	size_t fsize;
+
+#ifdef WITH_DIGEST
+	ZSDigest digest;
+#endif
+} ZSDedupSlot;
+
+int zs_dedup_add(ZSDedup *dd, struct ZSFile *zsf);
+void zs_dedup_free(ZSDedup *dd);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include "digest.h"
+#include "store.h"
+
+// SHA-256 and BLAKE2b through OpenSSL, which picks the SHA extensions or
+// AVX2 code paths of the CPU
+
+int zs_digest_init(ZSDigestCtx *ctx, int digests) {
+	memset(ctx, 0, sizeof(ZSDigestCtx));
+
+	ctx->digests = digests;
+
+	if(digests & ZS_DIGEST_SHA256) {
+		ctx->sha256 = EVP_MD_CTX_new();
+		if(ctx->sha256 == NULL)
+			goto error;
+	}
+
+	if(digests & ZS_DIGEST_BLAKE2B) {
+		ctx->blake2b = EVP_MD_CTX_new();
+		if(ctx->blake2b == NULL)
+			goto error;
+	}
+
+	return 0;
+
+error:
+	zs_digest_free(ctx);
+
+	return -1;
+}
+
+int zs_digest_start(ZSDigestCtx *ctx) {
+	if(ctx->sha256 != NULL && EVP_DigestInit_ex(ctx->sha256, EVP_sha256(), NULL) != 1)
+		return -1;
+
+	if(ctx->blake2b != NULL && EVP_DigestInit_ex(ctx->blake2b, EVP_blake2b512(), NULL) != 1)
+		return -1;
+
+	return 0;
+}
+
+void zs_digest_update(ZSDigestCtx *ctx, const void *data, size_t len) {
+	if(ctx->sha256 != NULL)
+		EVP_DigestUpdate(ctx->sha256, data, len);
+
+	if(ctx->blake2b != NULL)
+		EVP_DigestUpdate(ctx->blake2b, data, len);
+
+	return;
+}
+
+int zs_digest_finish(ZSDigestCtx *ctx, ZSDigest *digest) {
+	memset(digest, 0, sizeof(ZSDigest));
+
+	if(ctx->sha256 != NULL && EVP_DigestFinal_ex(ctx->sha256, digest->sha256, NULL) != 1)
+		return -1;
+
+	if(ctx->blake2b != NULL && EVP_DigestFinal_ex(ctx->blake2b, digest->blake2b, NULL) != 1)
+		return -1;
+
+	digest->digests = ctx->digests;
+
+	return 0;
+}
+
+void zs_digest_free(ZSDigestCtx *ctx) {
+	EVP_MD_CTX_free(ctx->sha256);
+	EVP_MD_CTX_free(ctx->blake2b);
+
+	memset(ctx, 0, sizeof(ZSDigestCtx));
+
+	return;
+}
+
+// "ALGO (name) = hex" line, see sha256sum --tag
+static int zs_digest_line(ZSStore *st, const char *algo, const char *name, const unsigned char *data, size_t len) {
+	char hex[2 * ZS_DIGEST_BLAKE2B_LENGTH + 1];
+	size_t i;
+	int rv = 0;
+
+	for(i = 0; i < len; i++)
+		snprintf(&hex[2 * i], 3, "%02x", data[i]);
+
+	rv |= zs_store_append(st, algo, strlen(algo));
+	rv |= zs_store_append(st, " (", 2);
+	rv |= zs_store_append(st, name, strlen(name));
+	rv |= zs_store_append(st, ") = ", 4);
+	rv |= zs_store_append(st, hex, 2 * len);
+	rv |= zs_store_append(st, "\n", 1);
+
+	return (rv != 0) ? -1 : 0;
+}
+
+// Lines for the manifest member, checkable with sha256sum -c and b2sum -c
+int zs_digest_manifest(ZSStore *st, const char *name, const ZSDigest *digest) {
+	if((digest->digests & ZS_DIGEST_SHA256) && zs_digest_line(st, "SHA256", name, digest->sha256, ZS_DIGEST_SHA256_LENGTH) != 0)
+		return -1;
+
+	if((digest->digests & ZS_DIGEST_BLAKE2B) && zs_digest_line(st, "BLAKE2b", name, digest->blake2b, ZS_DIGEST_BLAKE2B_LENGTH) != 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+#include "store.h"
+
+#define ZS_DIGEST_SHA256		0x01
+#define ZS_DIGEST_BLAKE2B		0x02	// BLAKE2b-512
+
+#define ZS_DIGEST_SHA256_LENGTH		32
+#define ZS_DIGEST_BLAKE2B_LENGTH	64
+
+// Digests of the uncompressed data of an entry
+typedef struct {
+	int digests;	// available ones, 0 for copied entries
+
+	unsigned char sha256[ZS_DIGEST_SHA256_LENGTH];
+	unsigned char blake2b[ZS_DIGEST_BLAKE2B_LENGTH];
+} ZSDigest;
+
+// Per reader hashing state
+typedef struct {
+	int digests;
+
+	EVP_MD_CTX *sha256;
+	EVP_MD_CTX *blake2b;
+} ZSDigestCtx;
+
+int zs_digest_init(ZSDigestCtx *ctx, int digests);
+int zs_digest_start(ZSDigestCtx *ctx);
+void zs_digest_update(ZSDigestCtx *ctx, const void *data, size_t len);
+int zs_digest_finish(ZSDigestCtx *ctx, ZSDigest *digest);
+void zs_digest_free(ZSDigestCtx *ctx);
+
+int zs_digest_manifest(ZSStore *st, const char *name, const ZSDigest *digest);
+
+#endif
@@ -0,0 +1,157 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "fingerprint.h"
+
+#define ZS_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+// See https://github.com/veorq/SipHash
+static void zs_sipround(uint64_t *v) {
+	v[0] += v[1];
+	v[1] = ZS_ROTL(v[1], 13);
+	v[1] ^= v[0];
+	v[0] = ZS_ROTL(v[0], 32);
+
+	v[2] += v[3];
+	v[3] = ZS_ROTL(v[3], 16);
+	v[3] ^= v[2];
+
+	v[0] += v[3];
+	v[3] = ZS_ROTL(v[3], 21);
+	v[3] ^= v[0];
+
+	v[2] += v[1];
+	v[1] = ZS_ROTL(v[1], 17);
+	v[1] ^= v[2];
+	v[2] = ZS_ROTL(v[2], 32);
+
+	return;
+}
+
+static uint64_t zs_fingerprint_load(const unsigned char *p) {
+	uint64_t m = 0;
+	int i;
+
+	for(i = 7; i >= 0; i--)
+		m = (m << 8) | p[i];
+
+	return m;
+}
+
+static void zs_fingerprint_block(uint64_t *v, uint64_t m) {
+	v[3] ^= m;
+
+	zs_sipround(v);
+	zs_sipround(v);
+
+	v[0] ^= m;
+
+	return;
+}
+
+void zs_fingerprint_init(ZSFingerprint *fp) {
+	// Key 00 01 02 .. 0f, as in the reference test vectors
+	const uint64_t k0 = 0x0706050403020100ULL;
+	const uint64_t k1 = 0x0f0e0d0c0b0a0908ULL;
+
+	memset(fp, 0, sizeof(ZSFingerprint));
+
+	fp->v[0] = k0 ^ 0x736f6d6570736575ULL;
+	fp->v[1] = k1 ^ 0x646f72616e646f6dULL ^ 0xee;
+	fp->v[2] = k0 ^ 0x6c7967656e657261ULL;
+	fp->v[3] = k1 ^ 0x7465646279746573ULL;
+
+	return;
+}
+
+void zs_fingerprint_update(ZSFingerprint *fp, const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *)data;
+	size_t n;
+
+	fp->len += len;
+
+	if(fp->ntail != 0) {
+		n = 8 - fp->ntail;
+		if(len < n)
+			n = len;
+
+		memcpy(&fp->tail[fp->ntail], p, n);
+		fp->ntail += n;
+		p += n;
+		len -= n;
+
+		if(fp->ntail < 8)
+			return;
+
+		zs_fingerprint_block(fp->v, zs_fingerprint_load(fp->tail));
+		fp->ntail = 0;
+	}
+
+	for(; len >= 8; p += 8, len -= 8)
+		zs_fingerprint_block(fp->v, zs_fingerprint_load(p));
+
+	memcpy(fp->tail, p, len);
+	fp->ntail = len;
+
+	return;
+}
+
+// Fixed width little endian, independent of the platform
+void zs_fingerprint_value(ZSFingerprint *fp, uint64_t value) {
+	unsigned char data[8];
+	int i;
+
+	for(i = 0; i < 8; i++)
+		data[i] = (value >> (8 * i)) & 0xFF;
+
+	zs_fingerprint_update(fp, data, 8);
+
+	return;
+}
+
+// Length prefixed, such that adjacent strings can't run into each other
+void zs_fingerprint_string(ZSFingerprint *fp, const char *s) {
+	size_t len = strlen(s);
+
+	zs_fingerprint_value(fp, len);
+	zs_fingerprint_update(fp, s, len);
+
+	return;
+}
+
+// Leaves fp as it is, more data can be added afterwards
+void zs_fingerprint_finish(const ZSFingerprint *fp, unsigned char out[ZS_FINGERPRINT_LENGTH]) {
+	unsigned char last[8];
+	uint64_t v[4], b;
+	int i;
+
+	memcpy(v, fp->v, sizeof(v));
+
+	memset(last, 0, sizeof(last));
+	memcpy(last, fp->tail, fp->ntail);
+
+	b = zs_fingerprint_load(last) | ((uint64_t)(fp->len & 0xFF) << 56);
+	zs_fingerprint_block(v, b);
+
+	v[2] ^= 0xee;
+
+	for(i = 0; i < 4; i++)
+		zs_sipround(v);
+
+	b = v[0] ^ v[1] ^ v[2] ^ v[3];
+
+	for(i = 0; i < 8; i++)
+		out[i] = (b >> (8 * i)) & 0xFF;
+
+	v[1] ^= 0xdd;
+
+	for(i = 0; i < 4; i++)
+		zs_sipround(v);
+
+	b = v[0] ^ v[1] ^ v[2] ^ v[3];
+
+	for(i = 0; i < 8; i++)
+		out[8 + i] = (b >> (8 * i)) & 0xFF;
+
+	return;
+}
@@ -0,0 +1,24 @@
+#ifndef _FINGERPRINT_H_
+#define _FINGERPRINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZS_FINGERPRINT_LENGTH	16
+
+// SipHash-2-4 with 128 bit output and a fixed key, fed incrementally
+typedef struct {
+	uint64_t v[4];
+
+	unsigned char tail[8];
+	size_t ntail;
+	size_t len;
+} ZSFingerprint;
+
+void zs_fingerprint_init(ZSFingerprint *fp);
+void zs_fingerprint_update(ZSFingerprint *fp, const void *data, size_t len);
+void zs_fingerprint_value(ZSFingerprint *fp, uint64_t value);
+void zs_fingerprint_string(ZSFingerprint *fp, const char *s);
+void zs_fingerprint_finish(const ZSFingerprint *fp, unsigned char out[ZS_FINGERPRINT_LENGTH]);
+
+#endif
@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <bzlib.h>
+
+#include "pool.h"
+#include "pbzip2.h"
+
+// Stream header "BZh" + level, block and end of stream magic (48 bits each,
+// as two halves)
+#define ZS_PBZIP2_BLOCK_HI	0x314159
+#define ZS_PBZIP2_BLOCK_LO	0x265359
+#define ZS_PBZIP2_EOS_HI	0x177245
+#define ZS_PBZIP2_EOS_LO	0x385090
+
+static int zs_pbzip2_grow(void **data, size_t *size, size_t need) {
+	void *p;
+
+	if(need <= *size)
+		return 0;
+
+	if(need < 2 * *size)
+		need = 2 * *size;
+
+	p = realloc(*data, need);
+	if(p == NULL)
+		return -1;
+
+	*data = p;
+	*size = need;
+
+	return 0;
+}
+
+static unsigned long zs_pbzip2_get(const unsigned char *data, size_t pos, int n) {
+	unsigned long value = 0;
+
+	for(; n > 0; n--, pos++)
+		value = (value << 1) | ((data[pos / 8] >> (7 - pos % 8)) & 1);
+
+	return value;
+}
+
+static void zs_pbzip2_put(ZSPbzip2 *pb, unsigned long value, int n) {
+	pb->acc = (pb->acc << n) | (value & ((1ULL << n) - 1));
+	pb->nacc += n;
+
+	while(pb->nacc >= 8) {
+		pb->nacc -= 8;
+		pb->out[pb->len++] = (pb->acc >> pb->nacc) & 0xff;
+	}
+
+	return;
+}
+
+// Compress a block as a stream of its own and locate its bits. Runs on the
+// pool.
+static void zs_pbzip2_block(void *arg) {
+	ZSPbzip2Block *block = (ZSPbzip2Block *)arg;
+	bz_stream strm;
+	size_t bound, n, end;
+	int rv, pad;
+
+	block->error = 1;
+
+	// See the bzip2 manual, BZ2_bzBuffToBuffCompress()
+	bound = block->len + block->len / 100 + 600;
+
+	if(zs_pbzip2_grow((void **)&block->out, &block->sout, bound) != 0)
+		goto done;
+
+	memset(&strm, 0, sizeof(bz_stream));
+
+	if(BZ2_bzCompressInit(&strm, block->level, 0, 30) != BZ_OK)
+		goto done;
+
+	strm.next_in = block->in;
+	strm.avail_in = block->len;
+	strm.next_out = (char *)block->out;
+	strm.avail_out = bound;
+
+	do {
+		rv = BZ2_bzCompress(&strm, BZ_FINISH);
+	} while(rv == BZ_FINISH_OK && strm.avail_out != 0);
+
+	BZ2_bzCompressEnd(&strm);
+
+	n = bound - strm.avail_out;
+
+	if(rv != BZ_STREAM_END || n < 4 + 10 + 10)
+		goto done;
+
+	if(zs_pbzip2_get(block->out, 32, 24) != ZS_PBZIP2_BLOCK_HI || zs_pbzip2_get(block->out, 56, 24) != ZS_PBZIP2_BLOCK_LO)
+		goto done;
+
+	block->crc = zs_pbzip2_get(block->out, 80, 32);
+
+	// The end of stream marker follows the block and is padded to a byte,
+	// its CRC equals the block CRC if there is a single block
+	for(pad = 0; pad < 8; pad++) {
+		end = 8 * n - pad;
+
+		if(pad != 0 && zs_pbzip2_get(block->out, end, pad) != 0)
+			continue;
+
+		if(zs_pbzip2_get(block->out, end - 80, 24) != ZS_PBZIP2_EOS_HI || zs_pbzip2_get(block->out, end - 56, 24) != ZS_PBZIP2_EOS_LO)
+			continue;
+
+		if(zs_pbzip2_get(block->out, end - 32, 32) != block->crc)
+			continue;
+
+		block->bits = end - 80 - 32;
+		block->error = 0;
+
+		break;
+	}
+
+done:
+	zs_wait_done(&block->wait);
+
+	return;
+}
+
+int zs_pbzip2_init(ZSPbzip2 *pb, ZSPool *pool, int level, int nblocks) {
+	int i;
+
+	memset(pb, 0, sizeof(ZSPbzip2));
+
+	if(pool == NULL || level < 1 || level > 9 || nblocks < 1)
+		return -1;
+
+	pb->blocks = (ZSPbzip2Block *)calloc(nblocks, sizeof(ZSPbzip2Block));
+	if(pb->blocks == NULL)
+		return -1;
+
+	for(i = 0; i < nblocks; i++)
+		zs_wait_init(&pb->blocks[i].wait);
+
+	pb->pool = pool;
+	pb->level = level;
+	pb->nblocks = nblocks;
+
+	// See BZ2_bzCompressInit()
+	pb->ch = 256;
+	pb->nblockmax = 100000 * level - 19;
+
+	if(zs_pbzip2_grow((void **)&pb->out, &pb->sout, 16) != 0) {
+		zs_pbzip2_free(pb);
+
+		return -1;
+	}
+
+	zs_pbzip2_put(pb, 'B', 8);
+	zs_pbzip2_put(pb, 'Z', 8);
+	zs_pbzip2_put(pb, 'h', 8);
+	zs_pbzip2_put(pb, '0' + level, 8);
+
+	return 0;
+}
+
+// Waits for the blocks that are still being compressed
+void zs_pbzip2_free(ZSPbzip2 *pb) {
+	int i;
+
+	if(pb->blocks == NULL)
+		return;
+
+	for(i = 0; i < pb->nblocks; i++) {
+		zs_wait(&pb->blocks[i].wait);
+		zs_wait_destroy(&pb->blocks[i].wait);
+
+		free(pb->blocks[i].in);
+		free(pb->blocks[i].out);
+	}
+
+	free(pb->blocks);
+	free(pb->out);
+
+	memset(pb, 0, sizeof(ZSPbzip2));
+
+	return;
+}
+
+// Start filling the next free block with the run that was still open when
+// the last one was cut
+static int zs_pbzip2_start(ZSPbzip2 *pb) {
+	ZSPbzip2Block *block;
+
+	block = &pb->blocks[(pb->head + pb->count) % pb->nblocks];
+
+	if(zs_pbzip2_grow((void **)&block->in, &block->sin, pb->nblockmax + 256) != 0) {
+		pb->error = 1;
+
+		return -1;
+	}
+
+	memset(block->in, pb->ch, pb->run);
+	block->len = pb->run;
+
+	pb->cur = block;
+
+	return 0;
+}
+
+static void zs_pbzip2_submit(ZSPbzip2 *pb, size_t len) {
+	ZSPbzip2Block *block = pb->cur;
+
+	block->len = len;
+	block->level = pb->level;
+
+	pb->cur = NULL;
+	pb->count++;
+	pb->nblock = 0;
+
+	zs_wait_add(&block->wait, 1);
+
+	// Waiting for it from a worker could block the whole pool
+	zs_pool_run(pb->pool, zs_pbzip2_block, block);
+
+	return;
+}
+
+// Add input, returns how much was taken. Stops early if all blocks are in
+// flight.
+size_t zs_pbzip2_feed(ZSPbzip2 *pb, const char *data, size_t len) {
+	ZSPbzip2Block *block;
+	size_t i = 0;
+	int c;
+
+	while(i < len && pb->error == 0) {
+		if(pb->cur == NULL) {
+			if(pb->count == pb->nblocks || zs_pbzip2_start(pb) != 0)
+				break;
+		}
+
+		// libbz2 checks before it takes the next byte. The open run
+		// isn't part of the block yet.
+		if(pb->nblock >= pb->nblockmax) {
+			zs_pbzip2_submit(pb, pb->cur->len - pb->run);
+			continue;
+		}
+
+		block = pb->cur;
+
+		if(block->len == block->sin && zs_pbzip2_grow((void **)&block->in, &block->sin, block->sin + 1) != 0) {
+			pb->error = 1;
+			break;
+		}
+
+		c = (unsigned char)data[i++];
+		block->in[block->len++] = c;
+
+		if(c != pb->ch && pb->run == 1) {
+			pb->nblock++;
+			pb->ch = c;
+		}
+		else if(c != pb->ch || pb->run == 255) {
+			if(pb->ch < 256)
+				pb->nblock += (pb->run < 4) ? pb->run : 5;
+
+			pb->ch = c;
+			pb->run = 1;
+		}
+		else
+			pb->run++;
+	}
+
+	return i;
+}
+
+// End of input, the rest goes into the last block. Has to be called again
+// if all blocks are in flight.
+void zs_pbzip2_finish(ZSPbzip2 *pb) {
+	if(pb->eof == 1 || pb->error == 1)
+		return;
+
+	if(pb->cur == NULL && pb->run != 0) {
+		if(pb->count == pb->nblocks || zs_pbzip2_start(pb) != 0)
+			return;
+	}
+
+	if(pb->cur != NULL)
+		zs_pbzip2_submit(pb, pb->cur->len);
+
+	pb->eof = 1;
+
+	return;
+}
+
+static int zs_pbzip2_join(ZSPbzip2 *pb, ZSPbzip2Block *block) {
+	const unsigned char *src = &block->out[4];
+	size_t i, full;
+	int rest;
+
+	if(block->error == 1)
+		return -1;
+
+	full = block->bits / 8;
+	rest = block->bits % 8;
+
+	if(zs_pbzip2_grow((void **)&pb->out, &pb->sout, pb->len + full + 16) != 0)
+		return -1;
+
+	if(pb->nacc == 0) {
+		memcpy(&pb->out[pb->len], src, full);
+		pb->len += full;
+	}
+	else {
+		for(i = 0; i < full; i++)
+			zs_pbzip2_put(pb, src[i], 8);
+	}
+
+	if(rest != 0)
+		zs_pbzip2_put(pb, src[full] >> (8 - rest), rest);
+
+	pb->combined = (((pb->combined << 1) | (pb->combined >> 31)) & 0xffffffff) ^ block->crc;
+
+	return 0;
+}
+
+// Output in order. Waits for the oldest block if all are in flight or the
+// input is complete. Returns 0 if more input is needed or the stream is
+// complete (eof set).
+int zs_pbzip2_read(ZSPbzip2 *pb, char *buf, int sbuf) {
+	ZSPbzip2Block *block;
+	size_t n;
+
+	for(;;) {
+		if(pb->pos < pb->len) {
+			n = pb->len - pb->pos;
+			if((size_t)sbuf < n)
+				n = sbuf;
+
+			memcpy(buf, &pb->out[pb->pos], n);
+			pb->pos += n;
+
+			return n;
+		}
+
+		if(pb->error == 1)
+			return -1;
+
+		pb->pos = 0;
+		pb->len = 0;
+
+		if(pb->count != 0 && (pb->count == pb->nblocks || pb->eof == 1)) {
+			block = &pb->blocks[pb->head];
+
+			zs_wait(&block->wait);
+
+			pb->head = (pb->head + 1) % pb->nblocks;
+			pb->count--;
+
+			if(zs_pbzip2_join(pb, block) != 0)
+				pb->error = 1;
+
+			continue;
+		}
+
+		if(pb->eof == 1 && pb->count == 0 && pb->trailer == 0) {
+			zs_pbzip2_put(pb, ZS_PBZIP2_EOS_HI, 24);
+			zs_pbzip2_put(pb, ZS_PBZIP2_EOS_LO, 24);
+			zs_pbzip2_put(pb, pb->combined, 32);
+
+			if(pb->nacc != 0)
+				zs_pbzip2_put(pb, 0, 8 - pb->nacc);
+
+			pb->trailer = 1;
+
+			continue;
+		}
+
+		return 0;
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef _PBZIP2_H_
+#define _PBZIP2_H_
+
+#include <stddef.h>
+
+#include "pool.h"
+
+// One block of input and its compressed stream
+typedef struct ZSPbzip2Block {
+	char *in;
+	size_t len;
+	size_t sin;
+
+	unsigned char *out;
+	size_t sout;
+
+	size_t bits;		// of the block, starting at byte 4 of out
+	unsigned long crc;	// block CRC
+
+	int level;
+	int error;
+
+	ZSWait wait;
+} ZSPbzip2Block;
+
+// A bzip2 stream whose blocks are compressed on a pool. The input is cut
+// where libbz2 would start a new block, every block is compressed as a
+// stream of its own and the blocks are joined at bit level, in order, into
+// one stream with the combined CRC.
+typedef struct ZSPbzip2 {
+	ZSPool *pool;
+	int level;
+
+	// Submitted blocks in order, and the one being filled
+	ZSPbzip2Block *blocks;
+	int nblocks;
+	int head;
+	int count;
+	ZSPbzip2Block *cur;
+
+	// Initial run length coding of libbz2, see ADD_CHAR_TO_BLOCK
+	int ch;
+	int run;
+	size_t nblock;
+	size_t nblockmax;
+
+	int eof;
+	int trailer;
+	int error;
+
+	// Output, the bits not yet making a byte are in acc
+	unsigned long combined;
+	unsigned long long acc;
+	int nacc;
+
+	unsigned char *out;
+	size_t sout;
+	size_t len;
+	size_t pos;
+} ZSPbzip2;
+
+int zs_pbzip2_init(ZSPbzip2 *pb, ZSPool *pool, int level, int nblocks);
+size_t zs_pbzip2_feed(ZSPbzip2 *pb, const char *data, size_t len);
+void zs_pbzip2_finish(ZSPbzip2 *pb);
+int zs_pbzip2_read(ZSPbzip2 *pb, char *buf, int sbuf);
+void zs_pbzip2_free(ZSPbzip2 *pb);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+static void *zs_pool_worker(void *arg) {
+	ZSPool *pool = (ZSPool *)arg;
+	ZSJob *job;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+
+		while(pool->head == NULL && pool->shutdown == 0)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if(pool->head == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		job = pool->head;
+		pool->head = job->next;
+		if(pool->head == NULL)
+			pool->tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+
+		free(job);
+	}
+
+	return NULL;
+}
+
+ZSPool *zs_pool_new(int nthreads) {
+	ZSPool *pool;
+
+	if(nthreads < 1)
+		return NULL;
+
+	pool = (ZSPool *)calloc(1, sizeof(ZSPool));
+	if(pool == NULL)
+		return NULL;
+
+	pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	if(pool->threads == NULL) {
+		free(pool);
+
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for(pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++) {
+		if(pthread_create(&pool->threads[pool->nthreads], NULL, zs_pool_worker, pool) != 0)
+			break;
+	}
+
+	if(pool->nthreads == 0) {
+		zs_pool_free(pool);
+
+		return NULL;
+	}
+
+	return pool;
+}
+
+int zs_pool_submit(ZSPool *pool, void (*fn)(void *), void *arg) {
+	ZSJob *job;
+
+	if(pool == NULL || fn == NULL)
+		return -1;
+
+	job = (ZSJob *)calloc(1, sizeof(ZSJob));
+	if(job == NULL)
+		return -1;
+
+	job->fn = fn;
+	job->arg = arg;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if(pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+
+	pool->tail = job;
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+// Submit a job whose completion the caller is going to wait for. It runs
+// right away if it can't be queued, or if the caller is a worker of the pool:
+// workers waiting for jobs queued behind them would otherwise deadlock.
+void zs_pool_run(ZSPool *pool, void (*fn)(void *), void *arg) {
+	int i;
+
+	for(i = 0; i < pool->nthreads; i++) {
+		if(pthread_equal(pthread_self(), pool->threads[i])) {
+			fn(arg);
+
+			return;
+		}
+	}
+
+	if(zs_pool_submit(pool, fn, arg) != 0)
+		fn(arg);
+
+	return;
+}
+
+// Runs the queued jobs to completion, then stops the workers
+void zs_pool_free(ZSPool *pool) {
+	int i;
+
+	if(pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->threads);
+	free(pool);
+
+	return;
+}
+
+void zs_wait_init(ZSWait *wait) {
+	wait->pending = 0;
+
+	pthread_mutex_init(&wait->lock, NULL);
+	pthread_cond_init(&wait->cond, NULL);
+
+	return;
+}
+
+void zs_wait_add(ZSWait *wait, int n) {
+	pthread_mutex_lock(&wait->lock);
+	wait->pending += n;
+	pthread_mutex_unlock(&wait->lock);
+
+	return;
+}
+
+void zs_wait_done(ZSWait *wait) {
+	pthread_mutex_lock(&wait->lock);
+
+	if(--wait->pending == 0)
+		pthread_cond_broadcast(&wait->cond);
+
+	pthread_mutex_unlock(&wait->lock);
+
+	return;
+}
+
+void zs_wait(ZSWait *wait) {
+	pthread_mutex_lock(&wait->lock);
+
+	while(wait->pending != 0)
+		pthread_cond_wait(&wait->cond, &wait->lock);
+
+	pthread_mutex_unlock(&wait->lock);
+
+	return;
+}
+
+void zs_wait_destroy(ZSWait *wait) {
+	pthread_cond_destroy(&wait->cond);
+	pthread_mutex_destroy(&wait->lock);
+
+	return;
+}
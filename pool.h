@@ -0,0 +1,46 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+
+// Fixed size worker pool, jobs are run in submission order
+typedef struct ZSJob {
+	void (*fn)(void *);
+	void *arg;
+
+	struct ZSJob *next;
+} ZSJob;
+
+typedef struct ZSPool {
+	pthread_t *threads;
+	int nthreads;
+
+	ZSJob *head;
+	ZSJob *tail;
+
+	int shutdown;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} ZSPool;
+
+// Waits for a group of jobs
+typedef struct {
+	int pending;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} ZSWait;
+
+ZSPool *zs_pool_new(int nthreads);
+int zs_pool_submit(ZSPool *pool, void (*fn)(void *), void *arg);
+void zs_pool_run(ZSPool *pool, void (*fn)(void *), void *arg);
+void zs_pool_free(ZSPool *pool);
+
+void zs_wait_init(ZSWait *wait);
+void zs_wait_add(ZSWait *wait, int n);
+void zs_wait_done(ZSWait *wait);
+void zs_wait(ZSWait *wait);
+void zs_wait_destroy(ZSWait *wait);
+
+#endif
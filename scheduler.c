@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "zipstream.h"
+#include "pool.h"
+#include "scheduler.h"
+
+static double zs_sched_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Highest class first, then the least weighted codec time. Streams that were
+// idle don't get to catch up on the time they didn't use.
+static ZSSchedStream *zs_sched_pick(ZSSched *sc, int *parked) {
+	ZSSchedStream *ss, *best = NULL;
+	int class, bclass = 0;
+
+	*parked = 0;
+
+	for(ss = sc->streams; ss != NULL; ss = ss->next) {
+		if(ss->running == 1 || ss->done == 1 || ss->error == 1)
+			continue;
+
+		if(ss->again != 0 && ss->again == sc->epoch) {
+			*parked = 1;
+			continue;
+		}
+
+		if(ss->sbuf - ss->len < ss->sbuf / 2)
+			continue;
+
+		if(ss->idle == 1) {
+			if(ss->vtime < sc->vtime)
+				ss->vtime = sc->vtime;
+
+			ss->idle = 0;
+		}
+
+		class = 2 * ss->priority + ((ss->total < ZS_SCHED_HEAD) ? 1 : 0);
+
+		if(best == NULL || class > bclass || (class == bclass && ss->vtime < best->vtime)) {
+			best = ss;
+			bclass = class;
+		}
+	}
+
+	if(best != NULL && best->vtime > sc->vtime)
+		sc->vtime = best->vtime;
+
+	return best;
+}
+
+// One turn of a stream, called with the lock held
+static void zs_sched_run(ZSSched *sc, ZSSchedStream *ss) {
+	void (*ready)(void *arg) = NULL;
+	size_t pos, span, produced = 0;
+	double start, elapsed;
+	int n;
+
+	ss->running = 1;
+
+	start = zs_sched_now();
+	elapsed = 0;
+
+	for(;;) {
+		if(ss->len == ss->sbuf) {
+			ss->idle = 1;
+			break;
+		}
+
+		// The free part of the ring up to its end, the owner only reads
+		// below it
+		pos = (ss->head + ss->len) % ss->sbuf;
+
+		span = ss->sbuf - ss->len;
+		if(ss->sbuf - pos < span)
+			span = ss->sbuf - pos;
+		if(span > ZS_SCHED_PIECE)
+			span = ZS_SCHED_PIECE;
+
+		pthread_mutex_unlock(&sc->lock);
+		n = zs_read(ss->zs, &ss->buf[pos], span);
+		elapsed = zs_sched_now() - start;
+		pthread_mutex_lock(&sc->lock);
+
+		if(n == ZSE_AGAIN) {
+			ss->again = sc->epoch;
+			ss->idle = 1;
+			break;
+		}
+
+		if(n < 0) {
+			ss->error = 1;
+			break;
+		}
+
+		ss->len += n;
+		ss->total += n;
+		produced += n;
+
+		if(ss->zs->stage == FIN) {
+			ss->done = 1;
+			break;
+		}
+
+		if(elapsed >= sc->quantum)
+			break;
+	}
+
+	ss->vtime += elapsed / ss->weight;
+
+	// Codec contexts may have been given back
+	if(produced != 0)
+		sc->epoch++;
+
+	if(produced != 0 || ss->done == 1 || ss->error == 1)
+		ready = ss->ready;
+
+	if(ready != NULL) {
+		pthread_mutex_unlock(&sc->lock);
+		ready(ss->arg);
+		pthread_mutex_lock(&sc->lock);
+	}
+
+	ss->running = 0;
+
+	pthread_cond_broadcast(&sc->cond);
+
+	return;
+}
+
+static void zs_sched_worker(void *arg) {
+	ZSSched *sc = (ZSSched *)arg;
+	ZSSchedStream *ss;
+	struct timespec until;
+	double t;
+	int parked;
+
+	pthread_mutex_lock(&sc->lock);
+
+	for(;;) {
+		ss = NULL;
+
+		while(sc->shutdown == 0 && (ss = zs_sched_pick(sc, &parked)) == NULL) {
+			if(parked == 0) {
+				pthread_cond_wait(&sc->cond, &sc->lock);
+				continue;
+			}
+
+			// The codecs may be held by cursors outside the scheduler,
+			// retry the parked streams after a quantum
+			clock_gettime(CLOCK_REALTIME, &until);
+
+			t = until.tv_nsec / 1e9 + sc->quantum;
+			until.tv_sec += (time_t)t;
+			until.tv_nsec = (long)((t - (time_t)t) * 1e9);
+
+			if(pthread_cond_timedwait(&sc->cond, &sc->lock, &until) != 0)
+				sc->epoch++;
+		}
+
+		if(ss == NULL)
+			break;
+
+		zs_sched_run(sc, ss);
+	}
+
+	pthread_mutex_unlock(&sc->lock);
+
+	return;
+}
+
+ZSSched *zs_sched_new(int nthreads, double quantum, size_t buffer) {
+	ZSSched *sc;
+	int i;
+
+	if(nthreads < 1)
+		return NULL;
+
+	sc = (ZSSched *)calloc(1, sizeof(ZSSched));
+	if(sc == NULL)
+		return NULL;
+
+	sc->quantum = (quantum > 0) ? quantum : ZS_SCHED_QUANTUM;
+	sc->buffer = (buffer != 0) ? buffer : ZS_SCHED_BUFFER;
+	sc->epoch = 1;
+
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->cond, NULL);
+
+	sc->pool = zs_pool_new(nthreads);
+	if(sc->pool == NULL) {
+		pthread_cond_destroy(&sc->cond);
+		pthread_mutex_destroy(&sc->lock);
+
+		free(sc);
+
+		return NULL;
+	}
+
+	// Each worker is a job that only returns on shutdown
+	for(i = 0; i < sc->pool->nthreads; i++) {
+		if(zs_pool_submit(sc->pool, zs_sched_worker, sc) != 0)
+			break;
+	}
+
+	sc->nthreads = i;
+
+	if(sc->nthreads == 0) {
+		zs_sched_free(sc);
+
+		return NULL;
+	}
+
+	return sc;
+}
+
+// Stops the workers after their current turn and drops the streams that are
+// still registered. The cursors are left to their owners.
+void zs_sched_free(ZSSched *sc) {
+	ZSSchedStream *ss;
+
+	if(sc == NULL)
+		return;
+
+	pthread_mutex_lock(&sc->lock);
+	sc->shutdown = 1;
+	pthread_cond_broadcast(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+
+	zs_pool_free(sc->pool);
+
+	while(sc->streams != NULL) {
+		ss = sc->streams;
+		sc->streams = ss->next;
+
+		free(ss->buf);
+		free(ss);
+	}
+
+	pthread_cond_destroy(&sc->cond);
+	pthread_mutex_destroy(&sc->lock);
+
+	free(sc);
+
+	return;
+}
+
+// The cursor must be open and not be read by anyone else until
+// zs_sched_remove(). ready (may be NULL) is called from a worker after each
+// turn that produced output or ended the stream, it may call zs_sched_read()
+// but not zs_sched_remove().
+ZSSchedStream *zs_sched_add(ZSSched *sc, ZS *zs, int weight, int priority, void (*ready)(void *arg), void *arg) {
+	ZSSchedStream *ss;
+
+	if(sc == NULL || zs == NULL || weight < 1 || priority < 0)
+		return NULL;
+
+	ss = (ZSSchedStream *)calloc(1, sizeof(ZSSchedStream));
+	if(ss == NULL)
+		return NULL;
+
+	ss->sbuf = sc->buffer;
+
+	ss->buf = (char *)malloc(ss->sbuf);
+	if(ss->buf == NULL) {
+		free(ss);
+
+		return NULL;
+	}
+
+	ss->sc = sc;
+	ss->zs = zs;
+	ss->weight = weight;
+	ss->priority = priority;
+	ss->ready = ready;
+	ss->arg = arg;
+
+	pthread_mutex_lock(&sc->lock);
+
+	// Starts level with the others
+	ss->vtime = sc->vtime;
+
+	ss->next = sc->streams;
+	sc->streams = ss;
+
+	pthread_cond_broadcast(&sc->cond);
+	pthread_mutex_unlock(&sc->lock);
+
+	return ss;
+}
+
+// Never blocks: the number of bytes copied, 0 at the end of the archive,
+// ZSE_AGAIN if nothing is ready yet, -1 on error
+int zs_sched_read(ZSSchedStream *ss, char *buf, int sbuf) {
+	ZSSched *sc;
+	size_t n, bytes = 0;
+	int rv;
+
+	if(ss == NULL || buf == NULL || sbuf < 0)
+		return -1;
+
+	sc = ss->sc;
+
+	pthread_mutex_lock(&sc->lock);
+
+	while(bytes < (size_t)sbuf && ss->len != 0) {
+		n = ss->sbuf - ss->head;
+		if(ss->len < n)
+			n = ss->len;
+		if((size_t)sbuf - bytes < n)
+			n = sbuf - bytes;
+
+		memcpy(&buf[bytes], &ss->buf[ss->head], n);
+
+		ss->head = (ss->head + n) % ss->sbuf;
+		ss->len -= n;
+		bytes += n;
+	}
+
+	if(bytes != 0) {
+		rv = bytes;
+
+		if(ss->running == 0 && ss->done == 0)
+			pthread_cond_broadcast(&sc->cond);
+	}
+	else if(ss->error == 1)
+		rv = -1;
+	else if(ss->done == 1)
+		rv = 0;
+	else
+		rv = ZSE_AGAIN;
+
+	pthread_mutex_unlock(&sc->lock);
+
+	return rv;
+}
+
+// Waits for a running turn to end, the cursor can be freed afterwards
+void zs_sched_remove(ZSSchedStream *ss) {
+	ZSSched *sc;
+	ZSSchedStream **pss;
+
+	if(ss == NULL)
+		return;
+
+	sc = ss->sc;
+
+	pthread_mutex_lock(&sc->lock);
+
+	while(ss->running == 1)
+		pthread_cond_wait(&sc->cond, &sc->lock);
+
+	for(pss = &sc->streams; *pss != NULL; pss = &(*pss)->next) {
+		if(*pss == ss) {
+			*pss = ss->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&sc->lock);
+
+	free(ss->buf);
+	free(ss);
+
+	return;
+}
@@ -0,0 +1,72 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "zipstream.h"
+#include "pool.h"
+
+#define ZS_SCHED_QUANTUM	0.01		// seconds of zs_read() per turn
+#define ZS_SCHED_BUFFER		(1024 * 1024)	// output kept per stream
+#define ZS_SCHED_PIECE		65536		// bytes per zs_read() call
+#define ZS_SCHED_HEAD		(1024 * 1024)	// output that runs ahead of its class
+
+struct ZSSched;
+
+// A registered cursor. Workers fill the ring buffer, the owner empties it
+// with zs_sched_read().
+typedef struct ZSSchedStream {
+	struct ZSSched *sc;
+	ZS *zs;
+
+	int weight;
+	int priority;
+	double vtime;		// codec time divided by weight
+	size_t total;		// output so far
+
+	char *buf;
+	size_t sbuf;
+	size_t head;
+	size_t len;
+
+	int running;
+	int idle;		// ran out of room or codecs, vtime is stale
+	int done;
+	int error;
+	unsigned long again;	// epoch of the last ZSE_AGAIN, 0: none
+
+	void (*ready)(void *arg);
+	void *arg;
+
+	struct ZSSchedStream *next;
+} ZSSchedStream;
+
+// Runs any number of cursors on a fixed set of workers. The stream with the
+// highest priority and the least weighted codec time goes next, the first
+// ZS_SCHED_HEAD bytes of a stream run ahead of the ones that are further.
+typedef struct ZSSched {
+	ZSPool *pool;
+	int nthreads;
+
+	double quantum;
+	size_t buffer;
+
+	double vtime;		// of the last stream picked
+	unsigned long epoch;	// bumped whenever a stream makes progress
+	int shutdown;
+
+	ZSSchedStream *streams;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} ZSSched;
+
+ZSSched *zs_sched_new(int nthreads, double quantum, size_t buffer);
+void zs_sched_free(ZSSched *sc);
+
+ZSSchedStream *zs_sched_add(ZSSched *sc, ZS *zs, int weight, int priority, void (*ready)(void *arg), void *arg);
+int zs_sched_read(ZSSchedStream *ss, char *buf, int sbuf);
+void zs_sched_remove(ZSSchedStream *ss);
+
+#endif
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zipstream.h"
+#include "zip.h"
+#include "store.h"
+
+// Entry record kinds
+#define ZS_STORE_DERIVED	0x01	// source path is basedir/name
+#define ZS_STORE_RAW		0x02	// CRC32, sizes and offset in the source archive follow
+
+// Compression and level are stored as unsigned varints, biased by the lowest
+// value they take (ZS_COMPRESS_MANIFEST, Z_DEFAULT_COMPRESSION)
+#define ZS_STORE_COMPRESSION_BIAS	2
+#define ZS_STORE_LEVEL_BIAS		1
+
+_Static_assert(ZS_COMPRESS_MANIFEST + ZS_STORE_COMPRESSION_BIAS >= 0, "ZS_STORE_COMPRESSION_BIAS too small");
+
+int zs_store_init(ZSStore *st, int spill) {
+	FILE *fp;
+
+	memset(st, 0, sizeof(ZSStore));
+
+	st->fd = -1;
+
+	if(spill == 0)
+		return 0;
+
+	fp = tmpfile();
+	if(fp == NULL)
+		return -1;
+
+	st->fd = dup(fileno(fp));
+	fclose(fp);
+
+	if(st->fd == -1)
+		return -1;
+
+	st->buf = (char *)malloc(ZS_STORE_BUFFER);
+	if(st->buf == NULL) {
+		close(st->fd);
+		st->fd = -1;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int zs_store_flush(ZSStore *st) {
+	size_t bytes;
+	ssize_t n;
+
+	if(st->fd == -1)
+		return 0;
+
+	for(bytes = 0; bytes < st->len; bytes += n) {
+		n = write(st->fd, &st->buf[bytes], st->len - bytes);
+		if(n <= 0)
+			return -1;
+	}
+
+	st->len = 0;
+
+	return 0;
+}
+
+int zs_store_append(ZSStore *st, const void *data, size_t len) {
+	const char *p = (const char *)data;
+	char **chunks;
+	size_t off, n;
+
+	while(len != 0) {
+		if(st->fd != -1) {
+			if(st->len == ZS_STORE_BUFFER && zs_store_flush(st) != 0)
+				return -1;
+
+			n = ZS_STORE_BUFFER - st->len;
+			if(len < n)
+				n = len;
+
+			memcpy(&st->buf[st->len], p, n);
+			st->len += n;
+		}
+		else {
+			off = st->size % ZS_STORE_CHUNK;
+
+			if(off == 0) {
+				chunks = (char **)realloc(st->chunks, (st->nchunks + 1) * sizeof(char *));
+				if(chunks == NULL)
+					return -1;
+
+				st->chunks = chunks;
+
+				st->chunks[st->nchunks] = (char *)malloc(ZS_STORE_CHUNK);
+				if(st->chunks[st->nchunks] == NULL)
+					return -1;
+
+				st->nchunks++;
+			}
+
+			n = ZS_STORE_CHUNK - off;
+			if(len < n)
+				n = len;
+
+			memcpy(&st->chunks[st->nchunks - 1][off], p, n);
+		}
+
+		st->size += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// LEB128
+int zs_store_varint(ZSStore *st, size_t v) {
+	unsigned char data[10];
+	int n = 0;
+
+	do {
+		data[n] = v & 0x7F;
+		v >>= 7;
+
+		if(v != 0)
+			data[n] |= 0x80;
+
+		n++;
+	} while(v != 0);
+
+	return zs_store_append(st, data, n);
+}
+
+// Up to len bytes from pos, a spilled store must have been flushed
+int zs_store_read(ZSStore *st, size_t pos, void *data, size_t len) {
+	char *p = (char *)data;
+	size_t bytes, off, n;
+	ssize_t r;
+
+	if(pos >= st->size)
+		return 0;
+
+	if(len > st->size - pos)
+		len = st->size - pos;
+
+	for(bytes = 0; bytes < len; bytes += n) {
+		if(st->fd != -1) {
+			r = pread(st->fd, &p[bytes], len - bytes, pos + bytes);
+			if(r <= 0)
+				return -1;
+
+			n = r;
+		}
+		else {
+			off = (pos + bytes) % ZS_STORE_CHUNK;
+
+			n = ZS_STORE_CHUNK - off;
+			if(len - bytes < n)
+				n = len - bytes;
+
+			memcpy(&p[bytes], &st->chunks[(pos + bytes) / ZS_STORE_CHUNK][off], n);
+		}
+	}
+
+	return bytes;
+}
+
+void zs_store_free(ZSStore *st) {
+	int i;
+
+	if(st->fd != -1)
+		close(st->fd);
+
+	for(i = 0; i < st->nchunks; i++)
+		free(st->chunks[i]);
+
+	free(st->chunks);
+	free(st->buf);
+
+	memset(st, 0, sizeof(ZSStore));
+
+	st->fd = -1;
+
+	return;
+}
+
+void zs_store_reader_init(ZSStoreReader *rd, ZSStore *st) {
+	char *buf = rd->buf;
+
+	memset(rd, 0, sizeof(ZSStoreReader));
+
+	rd->store = st;
+	rd->buf = buf;
+
+	return;
+}
+
+int zs_store_reader_eof(ZSStoreReader *rd) {
+	return (rd->off == rd->len && rd->pos + rd->len >= rd->store->size);
+}
+
+int zs_store_reader_get(ZSStoreReader *rd, void *data, size_t len) {
+	char *p = (char *)data;
+	size_t n;
+	int bytes;
+
+	if(rd->buf == NULL) {
+		rd->buf = (char *)malloc(ZS_STORE_BUFFER);
+		if(rd->buf == NULL)
+			return -1;
+	}
+
+	while(len != 0) {
+		if(rd->off == rd->len) {
+			rd->pos += rd->len;
+
+			bytes = zs_store_read(rd->store, rd->pos, rd->buf, ZS_STORE_BUFFER);
+			if(bytes <= 0)
+				return -1;
+
+			rd->len = bytes;
+			rd->off = 0;
+		}
+
+		n = rd->len - rd->off;
+		if(len < n)
+			n = len;
+
+		memcpy(p, &rd->buf[rd->off], n);
+		rd->off += n;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int zs_store_reader_varint(ZSStoreReader *rd, size_t *v) {
+	unsigned char c;
+	int shift = 0;
+
+	*v = 0;
+
+	do {
+		if(shift > 63 || zs_store_reader_get(rd, &c, 1) != 0)
+			return -1;
+
+		*v |= (size_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while(c & 0x80);
+
+	return 0;
+}
+
+void zs_store_reader_free(ZSStoreReader *rd) {
+	free(rd->buf);
+
+	memset(rd, 0, sizeof(ZSStoreReader));
+
+	return;
+}
+
+void zs_store_names_free(ZSStoreNames *names) {
+	free(names->name);
+	free(names->path);
+	free(names->source);
+
+	memset(names, 0, sizeof(ZSStoreNames));
+
+	return;
+}
+
+// Make room for len bytes and a NUL
+static int zs_store_grow(char **buf, size_t *size, size_t len) {
+	char *p;
+
+	if(len + 1 <= *size)
+		return 0;
+
+	p = (char *)realloc(*buf, len + 1);
+	if(p == NULL)
+		return -1;
+
+	*buf = p;
+	*size = len + 1;
+
+	return 0;
+}
+
+// Shared prefix with the previous string, then the rest
+static int zs_store_front(ZSStore *st, char **prev, size_t *lprev, size_t *sprev, const char *s, size_t len) {
+	size_t n = 0;
+
+	while(n < len && n < *lprev && (*prev)[n] == s[n])
+		n++;
+
+	if(zs_store_varint(st, n) != 0 || zs_store_varint(st, len - n) != 0 || zs_store_append(st, &s[n], len - n) != 0)
+		return -1;
+
+	if(zs_store_grow(prev, sprev, len) != 0)
+		return -1;
+
+	memcpy(*prev, s, len);
+	(*prev)[len] = '\0';
+	*lprev = len;
+
+	return 0;
+}
+
+static int zs_store_unfront(ZSStoreReader *rd, char **prev, size_t *lprev, size_t *sprev) {
+	size_t n, len;
+
+	if(zs_store_reader_varint(rd, &n) != 0 || zs_store_reader_varint(rd, &len) != 0)
+		return -1;
+
+	if(n > *lprev || zs_store_grow(prev, sprev, n + len) != 0)
+		return -1;
+
+	if(zs_store_reader_get(rd, &(*prev)[n], len) != 0)
+		return -1;
+
+	(*prev)[n + len] = '\0';
+	*lprev = n + len;
+
+	return 0;
+}
+
+// Append the record of an entry, about 20 bytes plus the part of the name
+// that differs from the previous one
+int zs_store_encode(ZSStore *st, ZSStoreNames *names, const char *basedir, ZSFile *zsf) {
+	size_t lbasedir, lpath;
+	int kind = 0, rv = 0;
+
+	lpath = strlen(zsf->fpath);
+
+	if(basedir != NULL) {
+		lbasedir = strlen(basedir);
+
+		if(lpath == lbasedir + 1 + zsf->lfname && strncmp(zsf->fpath, basedir, lbasedir) == 0 && zsf->fpath[lbasedir] == '/' && memcmp(&zsf->fpath[lbasedir + 1], zsf->fname, zsf->lfname) == 0)
+			kind |= ZS_STORE_DERIVED;
+	}
+
+	if(zsf->compression == ZS_COMPRESS_RAW)
+		kind |= ZS_STORE_RAW;
+
+	rv |= zs_store_varint(st, kind);
+
+	rv |= zs_store_front(st, &names->name, &names->lname, &names->sname, zsf->fname, zsf->lfname);
+	if(!(kind & ZS_STORE_DERIVED))
+		rv |= zs_store_front(st, &names->path, &names->lpath, &names->spath, zsf->fpath, lpath);
+
+	rv |= zs_store_varint(st, zsf->dostime);
+	rv |= zs_store_varint(st, zsf->fsize);
+	rv |= zs_store_varint(st, zsf->compression + ZS_STORE_COMPRESSION_BIAS);
+	rv |= zs_store_varint(st, zsf->level + ZS_STORE_LEVEL_BIAS);
+	rv |= zs_store_varint(st, zsf->version);
+	rv |= zs_store_varint(st, zsf->method);
+	rv |= zs_store_varint(st, zsf->flags);
+
+	if(kind & ZS_STORE_RAW) {
+		rv |= zs_store_varint(st, zsf->crc32);
+		rv |= zs_store_varint(st, zsf->fsize_compressed);
+		rv |= zs_store_varint(st, zsf->raw_offset);
+	}
+
+	rv |= zs_store_varint(st, zsf->lextra);
+	rv |= zs_store_append(st, zsf->extra, zsf->lextra);
+
+	return (rv != 0) ? -1 : 0;
+}
+
+// Read the next record into zsf. Its names point into names and are valid
+// until the next record.
+int zs_store_decode(ZSStoreReader *rd, ZSStoreNames *names, const char *basedir, ZSFile *zsf) {
+	size_t kind, v[7], lbasedir;
+	int i;
+
+	memset(zsf, 0, sizeof(ZSFile));
+
+	if(zs_store_reader_varint(rd, &kind) != 0)
+		return -1;
+
+	if(zs_store_unfront(rd, &names->name, &names->lname, &names->sname) != 0)
+		return -1;
+
+	zsf->fname = names->name;
+	zsf->lfname = names->lname;
+
+	if(kind & ZS_STORE_DERIVED) {
+		if(basedir == NULL)
+			return -1;
+
+		lbasedir = strlen(basedir);
+
+		if(zs_store_grow(&names->source, &names->ssource, lbasedir + 1 + names->lname) != 0)
+			return -1;
+
+		memcpy(names->source, basedir, lbasedir);
+		names->source[lbasedir] = '/';
+		memcpy(&names->source[lbasedir + 1], names->name, names->lname + 1);
+
+		zsf->fpath = names->source;
+	}
+	else {
+		if(zs_store_unfront(rd, &names->path, &names->lpath, &names->spath) != 0)
+			return -1;
+
+		zsf->fpath = names->path;
+	}
+
+	for(i = 0; i < 7; i++) {
+		if(zs_store_reader_varint(rd, &v[i]) != 0)
+			return -1;
+	}
+
+	zsf->dostime = v[0];
+	zsf->fsize = v[1];
+	zsf->compression = (int)v[2] - ZS_STORE_COMPRESSION_BIAS;
+	zsf->level = (int)v[3] - ZS_STORE_LEVEL_BIAS;
+	zsf->version = v[4];
+	zsf->method = v[5];
+	zsf->flags = v[6];
+
+	if(kind & ZS_STORE_RAW) {
+		for(i = 0; i < 3; i++) {
+			if(zs_store_reader_varint(rd, &v[i]) != 0)
+				return -1;
+		}
+
+		zsf->crc32 = v[0];
+		zsf->fsize_compressed = v[1];
+		zsf->raw_offset = v[2];
+		zsf->cached = 1;
+	}
+
+	if(zs_store_reader_varint(rd, &zsf->lextra) != 0 || zsf->lextra > ZS_EXTRA_LENGTH_MAX)
+		return -1;
+
+	if(zs_store_reader_get(rd, zsf->extra, zsf->lextra) != 0)
+		return -1;
+
+	zs_prepare_lfh(zsf);
+
+	return 0;
+}
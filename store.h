@@ -0,0 +1,70 @@
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <stddef.h>
+
+#define ZS_STORE_CHUNK		(1024 * 1024)
+#define ZS_STORE_BUFFER		65536
+
+// Append-only byte log, in memory chunks or spilled to an unlinked
+// temporary file
+typedef struct {
+	int fd;		// -1: in memory
+
+	char **chunks;
+	int nchunks;
+
+	size_t size;
+
+	// Write buffer of the file
+	char *buf;
+	size_t len;
+} ZSStore;
+
+// Sequential reader of a store
+typedef struct {
+	ZSStore *store;
+
+	char *buf;
+	size_t pos;	// store offset of buf
+	size_t len;
+	size_t off;
+} ZSStoreReader;
+
+// Previous name and source path of a sequence of entry records, they are
+// front coded against them
+typedef struct {
+	char *name;
+	size_t lname;
+	size_t sname;
+
+	char *path;
+	size_t lpath;
+	size_t spath;
+
+	// Source path derived from the base directory
+	char *source;
+	size_t ssource;
+} ZSStoreNames;
+
+struct ZSFile;
+
+int zs_store_init(ZSStore *st, int spill);
+int zs_store_append(ZSStore *st, const void *data, size_t len);
+int zs_store_varint(ZSStore *st, size_t v);
+int zs_store_flush(ZSStore *st);
+int zs_store_read(ZSStore *st, size_t pos, void *data, size_t len);
+void zs_store_free(ZSStore *st);
+
+void zs_store_reader_init(ZSStoreReader *rd, ZSStore *st);
+int zs_store_reader_eof(ZSStoreReader *rd);
+int zs_store_reader_get(ZSStoreReader *rd, void *data, size_t len);
+int zs_store_reader_varint(ZSStoreReader *rd, size_t *v);
+void zs_store_reader_free(ZSStoreReader *rd);
+
+void zs_store_names_free(ZSStoreNames *names);
+
+int zs_store_encode(ZSStore *st, ZSStoreNames *names, const char *basedir, struct ZSFile *zsf);
+int zs_store_decode(ZSStoreReader *rd, ZSStoreNames *names, const char *basedir, struct ZSFile *zsf);
+
+#endif
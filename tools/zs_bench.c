@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../zipstream.h"
+
+// Throughput of zs_read() for different caller buffer sizes, with and
+// without the output staging buffer.
+//
+// cc -O2 -DWITH_DEFLATE -DWITH_BZIP2 -DWITH_AES -DWITH_DIGEST -o zs_bench tools/zs_bench.c zip.c crc32.c
+//    pool.c unzip.c codec.c store.c dedup.c pbzip2.c fingerprint.c aes.c digest.c
+//    -lz -lbz2 -lpthread -lcrypto
+// ./zs_bench data/file [deflate|bzip2|none]
+
+double zs_bench(ZSPlan *zsp, int sbuf, int staging, size_t *total) {
+	ZS zs;
+	struct timespec start, end;
+	char *buf;
+	int bytes;
+
+	buf = (char *)malloc(sbuf);
+	if(buf == NULL)
+		return -1;
+
+	zs_open(&zs, zsp);
+
+	if(staging == 0)
+		zs_set_buffer(&zs, 0);
+
+	*total = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while((bytes = zs_read(&zs, buf, sbuf)) > 0)
+		*total += bytes;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	zs_free(&zs);
+	free(buf);
+
+	if(bytes < 0)
+		return -1;
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+	ZSPlan *zsp;
+	FILE *fp;
+	int compression = ZS_COMPRESS_NONE;
+	int sizes[] = {512, 1024, 2048, 4096, 16384, 65536, 262144};
+	int i, staging;
+	long fsize;
+	size_t total;
+	double t;
+
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s file [deflate|bzip2|none]\n", argv[0]);
+		return 1;
+	}
+
+#ifdef WITH_DEFLATE
+	compression = ZS_COMPRESS_DEFLATE;
+
+	if(argc > 2 && strcmp(argv[2], "deflate") == 0)
+		compression = ZS_COMPRESS_DEFLATE;
+#endif
+#ifdef WITH_BZIP2
+	if(argc > 2 && strcmp(argv[2], "bzip2") == 0)
+		compression = ZS_COMPRESS_BZIP2;
+#endif
+	if(argc > 2 && strcmp(argv[2], "none") == 0)
+		compression = ZS_COMPRESS_NONE;
+
+	fp = fopen(argv[1], "rb");
+	if(fp == NULL)
+		return 1;
+
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	fclose(fp);
+
+	zsp = zs_plan_new();
+	if(zs_plan_add_file(zsp, "bench", argv[1], compression, ZS_COMPRESS_LEVEL_SPEED) != 0)
+		return 1;
+
+	printf("%10s %14s %14s\n", "buffer", "direct MB/s", "staged MB/s");
+
+	for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		printf("%10d", sizes[i]);
+
+		for(staging = 0; staging < 2; staging++) {
+			t = zs_bench(zsp, sizes[i], staging, &total);
+			if(t < 0)
+				return 1;
+
+			printf(" %14.1f", fsize / t / 1e6);
+		}
+
+		printf("\n");
+	}
+
+	zs_plan_unref(zsp);
+
+	return 0;
+}
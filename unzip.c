@@ -0,0 +1,907 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WITH_DEFLATE
+	#include <zlib.h>
+#endif
+#ifdef WITH_BZIP2
+	#include <bzlib.h>
+#endif
+
+#include "zipstream.h"
+#include "zip.h"
+#include "unzip.h"
+#include "crc32.h"
+#include "pool.h"
+
+typedef struct {
+	ZSUnzipDirectory *zud;
+	ZSUnzipEntry *entry;
+	const char *directory;
+
+	int *errors;
+	pthread_mutex_t *lock;
+	ZSWait *wait;
+} ZSUnzipJob;
+
+static unsigned long zs_get16(const char *p) {
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (unsigned long)u[0] | ((unsigned long)u[1] << 8);
+}
+
+static unsigned long zs_get32(const char *p) {
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (unsigned long)u[0] | ((unsigned long)u[1] << 8) | ((unsigned long)u[2] << 16) | ((unsigned long)u[3] << 24);
+}
+
+int zs_decoder_init(ZSDecoder *zd, int method) {
+	memset(zd, 0, sizeof(ZSDecoder));
+
+	zd->method = method;
+	zd->crc32 = crc_start();
+
+	switch(method) {
+		case ZS_COMPRESS_NONE:
+			break;
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			if(inflateInit2(&zd->deflate, -15) != Z_OK)
+				return -1;
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			if(BZ2_bzDecompressInit(&zd->bzip2, 0, 0) != BZ_OK)
+				return -1;
+			break;
+#endif
+		default:
+			return -1;
+	}
+
+	zd->init = 1;
+
+	return 0;
+}
+
+// Feed up to *lin bytes and produce up to *lout bytes. On return they hold the
+// bytes consumed and produced. Returns 1 at the end of the compressed stream,
+// 0 if it wants more, -1 on error.
+int zs_decoder_run(ZSDecoder *zd, const char *in, size_t *lin, char *out, size_t *lout) {
+	size_t bytes;
+	int rv = 0;
+
+	if(*lin > ZS_UNZIP_BUFFER)
+		*lin = ZS_UNZIP_BUFFER;
+	if(*lout > ZS_UNZIP_BUFFER)
+		*lout = ZS_UNZIP_BUFFER;
+
+	switch(zd->method) {
+		case ZS_COMPRESS_NONE:
+			bytes = (*lin < *lout) ? *lin : *lout;
+			memcpy(out, in, bytes);
+
+			*lin = bytes;
+			*lout = bytes;
+			break;
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE: {
+			int err;
+
+			zd->deflate.next_in = (Bytef *)in;
+			zd->deflate.avail_in = *lin;
+			zd->deflate.next_out = (Bytef *)out;
+			zd->deflate.avail_out = *lout;
+
+			err = inflate(&zd->deflate, Z_NO_FLUSH);
+			if(err == Z_STREAM_END)
+				rv = 1;
+			else if(err != Z_OK && err != Z_BUF_ERROR)
+				rv = -1;
+
+			*lin -= zd->deflate.avail_in;
+			*lout -= zd->deflate.avail_out;
+			break;
+		}
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2: {
+			int err;
+
+			zd->bzip2.next_in = (char *)in;
+			zd->bzip2.avail_in = *lin;
+			zd->bzip2.next_out = out;
+			zd->bzip2.avail_out = *lout;
+
+			err = BZ2_bzDecompress(&zd->bzip2);
+			if(err == BZ_STREAM_END)
+				rv = 1;
+			else if(err != BZ_OK)
+				rv = -1;
+
+			*lin -= zd->bzip2.avail_in;
+			*lout -= zd->bzip2.avail_out;
+			break;
+		}
+#endif
+		default:
+			return -1;
+	}
+
+	if(rv != -1) {
+		zd->crc32 = crc_partial(zd->crc32, (const unsigned char *)out, *lout);
+		zd->fsize += *lout;
+	}
+
+	return rv;
+}
+
+void zs_decoder_free(ZSDecoder *zd) {
+	if(zd->init == 0)
+		return;
+
+	switch(zd->method) {
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			inflateEnd(&zd->deflate);
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			BZ2_bzDecompressEnd(&zd->bzip2);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	zd->init = 0;
+
+	return;
+}
+
+static int zs_unzip_fread(void *arg, char *buf, int sbuf) {
+	FILE *fp = (FILE *)arg;
+	int bytes;
+
+	bytes = fread(buf, 1, sbuf, fp);
+	if(bytes == 0 && ferror(fp))
+		return -1;
+
+	return bytes;
+}
+
+int zs_unzip_init(ZSUnzip *zu, int (*read)(void *, char *, int), void *arg) {
+	if(zu == NULL || read == NULL)
+		return -1;
+
+	memset(zu, 0, sizeof(ZSUnzip));
+
+	zu->read = read;
+	zu->arg = arg;
+
+	return 0;
+}
+
+int zs_unzip_open(ZSUnzip *zu, FILE *fp) {
+	if(fp == NULL)
+		return -1;
+
+	return zs_unzip_init(zu, zs_unzip_fread, fp);
+}
+
+void zs_unzip_free(ZSUnzip *zu) {
+	if(zu == NULL)
+		return;
+
+	zs_decoder_free(&zu->decoder);
+
+	free(zu->entry.name);
+
+	memset(zu, 0, sizeof(ZSUnzip));
+
+	return;
+}
+
+// Make at least n bytes available in the input buffer
+static int zs_unzip_need(ZSUnzip *zu, size_t n) {
+	int bytes;
+
+	if(zu->in_len - zu->in_pos >= n)
+		return 0;
+
+	if(zu->in_pos != 0) {
+		memmove(zu->in, &zu->in[zu->in_pos], zu->in_len - zu->in_pos);
+
+		zu->in_len -= zu->in_pos;
+		zu->in_pos = 0;
+	}
+
+	while(zu->in_len < n && zu->eof == 0) {
+		bytes = zu->read(zu->arg, &zu->in[zu->in_len], sizeof(zu->in) - zu->in_len);
+		if(bytes <= 0)
+			zu->eof = 1;
+		else
+			zu->in_len += bytes;
+	}
+
+	return (zu->in_len >= n) ? 0 : -1;
+}
+
+static int zs_unzip_skip(ZSUnzip *zu, size_t n) {
+	size_t bytes;
+
+	while(n != 0) {
+		if(zs_unzip_need(zu, 1) != 0)
+			return -1;
+
+		bytes = zu->in_len - zu->in_pos;
+		if(n < bytes)
+			bytes = n;
+
+		zu->in_pos += bytes;
+		n -= bytes;
+	}
+
+	return 0;
+}
+
+int zs_unzip_next(ZSUnzip *zu, ZSUnzipEntry **entry) {
+	char scratch[4096];
+	const char *p;
+	unsigned long signature;
+	size_t lextra;
+	int rv;
+
+	if(zu == NULL || entry == NULL)
+		return -1;
+
+	if(zu->finished == 1)
+		return 0;
+
+	// Skip what the caller didn't read
+	if(zu->active == 1) {
+		while((rv = zs_unzip_read(zu, scratch, sizeof(scratch))) > 0);
+
+		if(rv < 0)
+			return -1;
+	}
+
+	if(zs_unzip_need(zu, 4) != 0)
+		return -1;
+
+	signature = zs_get32(&zu->in[zu->in_pos]);
+
+	if(signature == ZS_UNZIP_SIGNATURE_CDH || signature == ZS_UNZIP_SIGNATURE_EOCD) {
+		zu->finished = 1;
+
+		return 0;
+	}
+
+	if(signature != ZS_UNZIP_SIGNATURE_LFH)
+		return -1;
+
+	if(zs_unzip_need(zu, ZS_LENGTH_LFH) != 0)
+		return -1;
+
+	p = &zu->in[zu->in_pos];
+
+	free(zu->entry.name);
+	memset(&zu->entry, 0, sizeof(ZSUnzipEntry));
+
+	zu->entry.version = zs_get16(&p[4]);
+	zu->entry.flags = zs_get16(&p[6]);
+	zu->entry.method = zs_get16(&p[8]);
+	zu->entry.dostime = zs_get16(&p[10]) | (zs_get16(&p[12]) << 16);
+	zu->entry.crc32 = zs_get32(&p[14]);
+	zu->entry.fsize_compressed = zs_get32(&p[18]);
+	zu->entry.fsize = zs_get32(&p[22]);
+	zu->entry.lname = zs_get16(&p[26]);
+	lextra = zs_get16(&p[28]);
+
+	zu->in_pos += ZS_LENGTH_LFH;
+
+	if(zs_unzip_need(zu, zu->entry.lname) != 0)
+		return -1;
+
+	zu->entry.name = (char *)malloc(zu->entry.lname + 1);
+	if(zu->entry.name == NULL)
+		return -1;
+
+	memcpy(zu->entry.name, &zu->in[zu->in_pos], zu->entry.lname);
+	zu->entry.name[zu->entry.lname] = '\0';
+
+	zu->in_pos += zu->entry.lname;
+
+	if(zs_unzip_skip(zu, lextra) != 0)
+		return -1;
+
+	// Encrypted entries can't be streamed
+	if(zu->entry.flags & ZS_FLAG_ENCRYPTED)
+		return -1;
+
+	if(zs_decoder_init(&zu->decoder, zu->entry.method) != 0)
+		return -1;
+
+	zu->active = 1;
+	zu->ended = 0;
+	zu->consumed = 0;
+
+	// Without a size, deflate and bzip2 find their own end, stored data
+	// ends where a matching data descriptor follows
+	zu->remaining = zu->entry.fsize_compressed;
+	if((zu->entry.flags & ZS_FLAG_DESCRIPTOR) && zu->entry.fsize_compressed == 0)
+		zu->remaining = (size_t)-1;
+
+	*entry = &zu->entry;
+
+	return 1;
+}
+
+// Stored data of unknown size: emit up to the next data descriptor candidate,
+// a candidate matching the CRC32 and size of the data so far ends the entry
+static int zs_unzip_scan(ZSUnzip *zu, char *buf, int sbuf) {
+	const char *p;
+	size_t i, avail, lin, lout;
+	unsigned long size;
+
+	if(zs_unzip_need(zu, ZS_LENGTH_LFD) != 0)
+		return -1;
+
+	p = &zu->in[zu->in_pos];
+	avail = zu->in_len - zu->in_pos;
+
+	size = zu->consumed & 0xFFFFFFFF;
+
+	if(zs_get32(&p[0]) == ZS_UNZIP_SIGNATURE_LFD && zs_get32(&p[4]) == crc_finish(zu->decoder.crc32) && zs_get32(&p[8]) == size && zs_get32(&p[12]) == size) {
+		zu->ended = 1;
+
+		return 0;
+	}
+
+	for(i = 1; i + 4 <= avail; i++) {
+		if(p[i] == 'P' && p[i + 1] == 'K' && p[i + 2] == 0x07 && p[i + 3] == 0x08)
+			break;
+	}
+
+	lin = i;
+	lout = sbuf;
+
+	if(zs_decoder_run(&zu->decoder, p, &lin, buf, &lout) < 0)
+		return -1;
+
+	zu->in_pos += lin;
+	zu->consumed += lin;
+
+	return lout;
+}
+
+static int zs_unzip_finish(ZSUnzip *zu) {
+	ZSUnzipEntry *entry = &zu->entry;
+	const char *p;
+	unsigned long crc;
+	size_t fsize;
+
+	zu->active = 0;
+
+	crc = crc_finish(zu->decoder.crc32);
+	fsize = zu->decoder.fsize;
+
+	zs_decoder_free(&zu->decoder);
+
+	if(entry->flags & ZS_FLAG_DESCRIPTOR) {
+		if(zs_unzip_need(zu, 12) != 0)
+			return -1;
+
+		// The signature is optional
+		if(zs_get32(&zu->in[zu->in_pos]) == ZS_UNZIP_SIGNATURE_LFD) {
+			if(zs_unzip_need(zu, ZS_LENGTH_LFD) != 0)
+				return -1;
+
+			zu->in_pos += 4;
+		}
+
+		p = &zu->in[zu->in_pos];
+
+		entry->crc32 = zs_get32(&p[0]);
+		entry->fsize_compressed = zs_get32(&p[4]);
+		entry->fsize = zs_get32(&p[8]);
+
+		zu->in_pos += 12;
+	}
+
+	if(crc != entry->crc32)
+		return -1;
+
+	if((fsize & 0xFFFFFFFF) != entry->fsize || (zu->consumed & 0xFFFFFFFF) != entry->fsize_compressed)
+		return -1;
+
+	return 0;
+}
+
+// Data of the current entry. Returns 0 at its end, after the CRC32 and the
+// sizes have been verified.
+int zs_unzip_read(ZSUnzip *zu, char *buf, int sbuf) {
+	size_t lin, lout;
+	int bytes, rv;
+
+	if(zu == NULL || buf == NULL || sbuf <= 0)
+		return -1;
+
+	if(zu->active == 0)
+		return 0;
+
+	bytes = 0;
+
+	while(bytes == 0 && zu->ended == 0) {
+		if(zu->remaining == (size_t)-1 && zu->entry.method == ZS_COMPRESS_NONE) {
+			rv = zs_unzip_scan(zu, buf, sbuf);
+			if(rv < 0)
+				return -1;
+
+			bytes += rv;
+
+			continue;
+		}
+
+		if(zu->remaining == 0 && zu->entry.method == ZS_COMPRESS_NONE) {
+			zu->ended = 1;
+			break;
+		}
+
+		if(zs_unzip_need(zu, 1) != 0)
+			return -1;
+
+		lin = zu->in_len - zu->in_pos;
+		if(lin > zu->remaining)
+			lin = zu->remaining;
+
+		lout = sbuf;
+
+		rv = zs_decoder_run(&zu->decoder, &zu->in[zu->in_pos], &lin, buf, &lout);
+		if(rv < 0)
+			return -1;
+
+		zu->in_pos += lin;
+		zu->consumed += lin;
+		if(zu->remaining != (size_t)-1)
+			zu->remaining -= lin;
+
+		bytes += lout;
+
+		if(rv == 1)
+			zu->ended = 1;
+		else if(lin == 0 && lout == 0)
+			return -1;	// truncated
+	}
+
+	if(bytes == 0 && zu->ended == 1) {
+		if(zs_unzip_finish(zu) != 0)
+			return -1;
+	}
+
+	return bytes;
+}
+
+// Target path of an entry below directory, NULL for names escaping it
+static char *zs_unzip_path(const char *directory, const char *name) {
+	const char *p;
+	char *path;
+
+	if(name[0] == '/' || name[0] == '\0')
+		return NULL;
+
+	for(p = name; p != NULL; p = strchr(p, '/')) {
+		if(*p == '/')
+			p++;
+
+		if(p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return NULL;
+	}
+
+	path = (char *)malloc(strlen(directory) + strlen(name) + 2);
+	if(path == NULL)
+		return NULL;
+
+	sprintf(path, "%s/%s", directory, name);
+
+	return path;
+}
+
+// Create all directories of path, the last component only if it ends with /
+static int zs_unzip_mkdirs(char *path) {
+	char *p;
+
+	for(p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+
+		if(mkdir(path, 0755) == -1 && errno != EEXIST) {
+			*p = '/';
+
+			return -1;
+		}
+
+		*p = '/';
+	}
+
+	return 0;
+}
+
+int zs_unzip_extract_stream(ZSUnzip *zu, const char *directory) {
+	ZSUnzipEntry *entry;
+	char buf[ZS_UNZIP_BUFFER];
+	char *path;
+	FILE *fp;
+	int rv, bytes;
+
+	if(zu == NULL || directory == NULL)
+		return -1;
+
+	while((rv = zs_unzip_next(zu, &entry)) == 1) {
+		path = zs_unzip_path(directory, entry->name);
+		if(path == NULL)
+			return -1;
+
+		if(zs_unzip_mkdirs(path) != 0) {
+			free(path);
+
+			return -1;
+		}
+
+		if(entry->name[entry->lname - 1] == '/') {
+			free(path);
+
+			continue;
+		}
+
+		fp = fopen(path, "wb");
+		if(fp == NULL) {
+			free(path);
+
+			return -1;
+		}
+
+		while((bytes = zs_unzip_read(zu, buf, sizeof(buf))) > 0) {
+			if(fwrite(buf, 1, bytes, fp) != (size_t)bytes) {
+				bytes = -1;
+				break;
+			}
+		}
+
+		fclose(fp);
+
+		if(bytes < 0) {
+			unlink(path);
+			free(path);
+
+			return -1;
+		}
+
+		free(path);
+	}
+
+	return rv;
+}
+
+int zs_unzip_directory(ZSUnzipDirectory *zud, const char *path) {
+	struct stat sb;
+	char *buf = NULL, *cd = NULL, *p;
+	size_t tail, cdsize, cdoffset, pos, lname;
+	long i;
+	int n;
+
+	if(zud == NULL || path == NULL)
+		return -1;
+
+	memset(zud, 0, sizeof(ZSUnzipDirectory));
+
+	zud->fd = open(path, O_RDONLY);
+	if(zud->fd == -1)
+		return -1;
+
+	if(fstat(zud->fd, &sb) == -1 || sb.st_size < ZS_LENGTH_EOCD)
+		goto error;
+
+	// End of central directory, followed by a comment of up to 64 KiB
+	tail = ZS_LENGTH_EOCD + 0xFFFF;
+	if(tail > (size_t)sb.st_size)
+		tail = sb.st_size;
+
+	buf = (char *)malloc(tail);
+	if(buf == NULL)
+		goto error;
+
+	if(pread(zud->fd, buf, tail, sb.st_size - tail) != (ssize_t)tail)
+		goto error;
+
+	for(i = tail - ZS_LENGTH_EOCD; i >= 0; i--) {
+		if(zs_get32(&buf[i]) == ZS_UNZIP_SIGNATURE_EOCD && i + ZS_LENGTH_EOCD + zs_get16(&buf[i + 20]) == tail)
+			break;
+	}
+
+	if(i < 0)
+		goto error;
+
+	zud->nentries = zs_get16(&buf[i + 10]);
+	cdsize = zs_get32(&buf[i + 12]);
+	cdoffset = zs_get32(&buf[i + 16]);
+
+	// ZIP64 is not supported
+	if(zud->nentries == 0xFFFF || cdsize == 0xFFFFFFFF || cdoffset == 0xFFFFFFFF)
+		goto error;
+
+	if(cdoffset + cdsize > (size_t)sb.st_size)
+		goto error;
+
+	cd = (char *)malloc(cdsize + 1);
+	zud->entries = (ZSUnzipEntry *)calloc(zud->nentries + 1, sizeof(ZSUnzipEntry));
+	if(cd == NULL || zud->entries == NULL)
+		goto error;
+
+	if(pread(zud->fd, cd, cdsize, cdoffset) != (ssize_t)cdsize)
+		goto error;
+
+	pos = 0;
+
+	for(n = 0; n < zud->nentries; n++) {
+		if(pos + ZS_LENGTH_CDH > cdsize)
+			goto error;
+
+		p = &cd[pos];
+
+		if(zs_get32(p) != ZS_UNZIP_SIGNATURE_CDH)
+			goto error;
+
+		lname = zs_get16(&p[28]);
+
+		if(pos + ZS_LENGTH_CDH + lname > cdsize)
+			goto error;
+
+		zud->entries[n].version = zs_get16(&p[6]);
+		zud->entries[n].flags = zs_get16(&p[8]);
+		zud->entries[n].method = zs_get16(&p[10]);
+		zud->entries[n].dostime = zs_get16(&p[12]) | (zs_get16(&p[14]) << 16);
+		zud->entries[n].crc32 = zs_get32(&p[16]);
+		zud->entries[n].fsize_compressed = zs_get32(&p[20]);
+		zud->entries[n].fsize = zs_get32(&p[24]);
+		zud->entries[n].offset = zs_get32(&p[42]);
+
+		zud->entries[n].lname = lname;
+		zud->entries[n].name = (char *)malloc(lname + 1);
+		if(zud->entries[n].name == NULL)
+			goto error;
+
+		memcpy(zud->entries[n].name, &p[ZS_LENGTH_CDH], lname);
+		zud->entries[n].name[lname] = '\0';
+
+		pos += ZS_LENGTH_CDH + lname + zs_get16(&p[30]) + zs_get16(&p[32]);
+	}
+
+	// A count that wrapped in an archive without ZIP64 leaves records behind
+	if(pos != cdsize)
+		goto error;
+
+	free(buf);
+	free(cd);
+
+	return 0;
+
+error:
+	free(buf);
+	free(cd);
+
+	zs_unzip_directory_free(zud);
+
+	return -1;
+}
+
+// Offset of the data of an entry, behind its local header
+int zs_unzip_data_offset(ZSUnzipDirectory *zud, ZSUnzipEntry *entry, size_t *offset) {
+	char lfh[ZS_LENGTH_LFH];
+
+	if(pread(zud->fd, lfh, ZS_LENGTH_LFH, entry->offset) != ZS_LENGTH_LFH)
+		return -1;
+
+	if(zs_get32(lfh) != ZS_UNZIP_SIGNATURE_LFH)
+		return -1;
+
+	*offset = entry->offset + ZS_LENGTH_LFH + zs_get16(&lfh[26]) + zs_get16(&lfh[28]);
+
+	return 0;
+}
+
+void zs_unzip_directory_free(ZSUnzipDirectory *zud) {
+	int n;
+
+	if(zud == NULL)
+		return;
+
+	if(zud->entries != NULL) {
+		for(n = 0; n < zud->nentries; n++)
+			free(zud->entries[n].name);
+
+		free(zud->entries);
+	}
+
+	if(zud->fd > 0)
+		close(zud->fd);
+
+	memset(zud, 0, sizeof(ZSUnzipDirectory));
+
+	return;
+}
+
+static int zs_unzip_extract_entry(ZSUnzipDirectory *zud, ZSUnzipEntry *entry, const char *directory) {
+	ZSDecoder zd;
+	char *path, *in = NULL, *out = NULL;
+	size_t offset, remaining, inpos, inlen, lin, lout;
+	ssize_t bytes;
+	int fd = -1, rv = -1, end;
+
+	path = zs_unzip_path(directory, entry->name);
+	if(path == NULL)
+		return -1;
+
+	if(zs_unzip_mkdirs(path) != 0)
+		goto done;
+
+	if(entry->name[entry->lname - 1] == '/') {
+		rv = 0;
+		goto done;
+	}
+
+	if(entry->flags & ZS_FLAG_ENCRYPTED)
+		goto done;
+
+	if(zs_unzip_data_offset(zud, entry, &offset) != 0)
+		goto done;
+
+	if(zs_decoder_init(&zd, entry->method) != 0)
+		goto done;
+
+	in = (char *)malloc(ZS_UNZIP_BUFFER);
+	out = (char *)malloc(ZS_UNZIP_BUFFER);
+	if(in == NULL || out == NULL)
+		goto decoder;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1)
+		goto decoder;
+
+	remaining = entry->fsize_compressed;
+	inpos = 0;
+	inlen = 0;
+	end = 0;
+
+	while(end == 0) {
+		if(inpos == inlen) {
+			if(remaining == 0) {
+				// Stored data ends with its size
+				if(entry->method == ZS_COMPRESS_NONE)
+					break;
+
+				goto decoder;
+			}
+
+			inlen = (remaining < ZS_UNZIP_BUFFER) ? remaining : ZS_UNZIP_BUFFER;
+
+			bytes = pread(zud->fd, in, inlen, offset);
+			if(bytes <= 0)
+				goto decoder;
+
+			inlen = bytes;
+			inpos = 0;
+
+			offset += bytes;
+			remaining -= bytes;
+		}
+
+		lin = inlen - inpos;
+		lout = ZS_UNZIP_BUFFER;
+
+		end = zs_decoder_run(&zd, &in[inpos], &lin, out, &lout);
+		if(end < 0)
+			goto decoder;
+
+		inpos += lin;
+
+		if(lout != 0 && write(fd, out, lout) != (ssize_t)lout)
+			goto decoder;
+
+		if(end == 0 && lin == 0 && lout == 0 && inpos != inlen)
+			goto decoder;
+	}
+
+	if(crc_finish(zd.crc32) == entry->crc32 && (zd.fsize & 0xFFFFFFFF) == entry->fsize)
+		rv = 0;
+
+decoder:
+	zs_decoder_free(&zd);
+
+done:
+	if(fd != -1) {
+		close(fd);
+
+		if(rv != 0)
+			unlink(path);
+	}
+
+	free(in);
+	free(out);
+	free(path);
+
+	return rv;
+}
+
+static void zs_unzip_extract_job(void *arg) {
+	ZSUnzipJob *job = (ZSUnzipJob *)arg;
+
+	if(zs_unzip_extract_entry(job->zud, job->entry, job->directory) != 0) {
+		pthread_mutex_lock(job->lock);
+		(*job->errors)++;
+		pthread_mutex_unlock(job->lock);
+	}
+
+	zs_wait_done(job->wait);
+
+	return;
+}
+
+// Extract a seekable archive below directory, driven by its central
+// directory. With a pool the entries are decompressed in parallel.
+int zs_unzip_extract(const char *path, const char *directory, ZSPool *pool) {
+	ZSUnzipDirectory zud;
+	ZSUnzipJob *jobs;
+	ZSWait wait;
+	pthread_mutex_t lock;
+	int n, errors = 0;
+
+	if(path == NULL || directory == NULL)
+		return -1;
+
+	if(zs_unzip_directory(&zud, path) != 0)
+		return -1;
+
+	jobs = (ZSUnzipJob *)calloc(zud.nentries + 1, sizeof(ZSUnzipJob));
+	if(jobs == NULL) {
+		zs_unzip_directory_free(&zud);
+
+		return -1;
+	}
+
+	pthread_mutex_init(&lock, NULL);
+	zs_wait_init(&wait);
+	zs_wait_add(&wait, zud.nentries);
+
+	for(n = 0; n < zud.nentries; n++) {
+		jobs[n].zud = &zud;
+		jobs[n].entry = &zud.entries[n];
+		jobs[n].directory = directory;
+		jobs[n].errors = &errors;
+		jobs[n].lock = &lock;
+		jobs[n].wait = &wait;
+
+		if(pool == NULL || zs_pool_submit(pool, zs_unzip_extract_job, &jobs[n]) != 0)
+			zs_unzip_extract_job(&jobs[n]);
+	}
+
+	zs_wait(&wait);
+
+	zs_wait_destroy(&wait);
+	pthread_mutex_destroy(&lock);
+
+	free(jobs);
+
+	zs_unzip_directory_free(&zud);
+
+	return (errors == 0) ? 0 : -1;
+}
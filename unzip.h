@@ -0,0 +1,97 @@
+#ifndef _UNZIP_H_
+#define _UNZIP_H_
+
+#include "zipstream.h"
+
+#define ZS_UNZIP_BUFFER			65536
+
+#define ZS_UNZIP_SIGNATURE_LFH		0x04034b50
+#define ZS_UNZIP_SIGNATURE_LFD		0x08074b50
+#define ZS_UNZIP_SIGNATURE_CDH		0x02014b50
+#define ZS_UNZIP_SIGNATURE_EOCD		0x06054b50
+
+typedef struct {
+	char *name;
+	size_t lname;
+
+	int version;
+	int flags;
+	int method;
+
+	unsigned long dostime;
+
+	unsigned long crc32;
+	size_t fsize_compressed;
+	size_t fsize;
+
+	// Local header (central directory only)
+	size_t offset;
+} ZSUnzipEntry;
+
+// Decompresses the data of one entry and sums it up
+typedef struct {
+	int method;
+	int init;
+
+	unsigned long crc32;
+	size_t fsize;
+
+#ifdef WITH_DEFLATE
+	z_stream deflate;
+#endif
+#ifdef WITH_BZIP2
+	bz_stream bzip2;
+#endif
+} ZSDecoder;
+
+// Streaming reader, pulls the archive through a read callback
+typedef struct ZSUnzip {
+	// Source
+	int (*read)(void *, char *, int);
+	void *arg;
+
+	// Input buffer
+	char in[ZS_UNZIP_BUFFER];
+	size_t in_pos;
+	size_t in_len;
+	int eof;
+
+	// Current entry
+	ZSUnzipEntry entry;
+	int active;
+	int ended;
+	size_t remaining;	// compressed bytes left, if the sizes are known
+	size_t consumed;	// compressed bytes so far
+
+	ZSDecoder decoder;
+
+	// Central directory reached
+	int finished;
+} ZSUnzip;
+
+// Central directory of a seekable archive
+typedef struct {
+	int fd;
+
+	int nentries;
+	ZSUnzipEntry *entries;
+} ZSUnzipDirectory;
+
+int zs_decoder_init(ZSDecoder *zd, int method);
+int zs_decoder_run(ZSDecoder *zd, const char *in, size_t *lin, char *out, size_t *lout);
+void zs_decoder_free(ZSDecoder *zd);
+
+int zs_unzip_init(ZSUnzip *zu, int (*read)(void *, char *, int), void *arg);
+int zs_unzip_open(ZSUnzip *zu, FILE *fp);
+int zs_unzip_next(ZSUnzip *zu, ZSUnzipEntry **entry);
+int zs_unzip_read(ZSUnzip *zu, char *buf, int sbuf);
+int zs_unzip_extract_stream(ZSUnzip *zu, const char *directory);
+void zs_unzip_free(ZSUnzip *zu);
+
+int zs_unzip_directory(ZSUnzipDirectory *zud, const char *path);
+int zs_unzip_data_offset(ZSUnzipDirectory *zud, ZSUnzipEntry *entry, size_t *offset);
+void zs_unzip_directory_free(ZSUnzipDirectory *zud);
+
+int zs_unzip_extract(const char *path, const char *directory, ZSPool *pool);
+
+#endif
@@ -2,8 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifdef WITH_DEFLATE
 	#include <zlib.h>
@@ -15,393 +19,2619 @@
 #include "zipstream.h"
 #include "zip.h"
 #include "crc32.h"
+#include "pool.h"
+#include "unzip.h"
+#include "dedup.h"
+#include "fingerprint.h"
+#ifdef WITH_AES
+	#include "aes.h"
+#endif
+#ifdef WITH_DIGEST
+	#include "digest.h"
+#endif
 
-void zs_init(ZS *zs) {
-	if(zs == NULL)
-		return;
+ZSPlan *zs_plan_new(void) {
+	ZSPlan *zsp;
 
-	memset(zs, 0, sizeof(ZS));
+	zsp = (ZSPlan *)calloc(1, sizeof(ZSPlan));
+	if(zsp == NULL)
+		return NULL;
 
-	return;
+	if(pthread_mutex_init(&zsp->lock, NULL) != 0) {
+		free(zsp);
+
+		return NULL;
+	}
+
+	zsp->refs = 1;
+
+	zs_fingerprint_init(&zsp->fingerprint);
+
+	return zsp;
 }
 
-void zs_free(ZS *zs) {
+ZSPlan *zs_plan_ref(ZSPlan *zsp) {
+	if(zsp == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&zsp->lock);
+	zsp->refs++;
+	pthread_mutex_unlock(&zsp->lock);
+
+	return zsp;
+}
+
+void zs_plan_unref(ZSPlan *zsp) {
 	ZSFile *zsf, *pzsf;
+	int refs;
 
-	if(zs == NULL)
+	if(zsp == NULL)
 		return;
 
-	if(zs->fp != NULL)
-		fclose(zs->fp);
+	pthread_mutex_lock(&zsp->lock);
+	refs = --zsp->refs;
+	pthread_mutex_unlock(&zsp->lock);
 
-	zsf = zs->zsd.files;
+	if(refs != 0)
+		return;
 
-	while(zsf != NULL) {
-		free(zsf->fpath);
-		free(zsf->fname);
+	zsf = zsp->zsd.files;
 
+	while(zsf != NULL) {
 		pzsf = zsf;
 		zsf = zsf->next;
 
-		free(pzsf);
+		zs_file_free(pzsf);
 	}
 
-	zs_init(zs);
+	free(zsp->index);
+	free(zsp->cdindex);
+
+	if(zsp->compact.enabled == 1) {
+		zs_store_free(&zsp->compact.store);
+		zs_store_names_free(&zsp->compact.names);
+
+		free(zsp->compact.basedir);
+	}
+
+	zs_dedup_free(&zsp->dedup);
+
+#ifdef WITH_DIGEST
+	free(zsp->digest.manifest);
+#endif
+
+	pthread_mutex_destroy(&zsp->lock);
+
+	free(zsp);
 
 	return;
 }
 
-int zs_add_file(ZS *zs, const char *targetpath, const char *sourcepath, int compression, int level) {
-	ZSFile *zsf, *pzsf;
-	struct stat sb;
+// Pool for parallel work, e.g. the CRC32 of mapped files. The pool must
+// outlive the plan.
+int zs_plan_set_pool(ZSPlan *zsp, ZSPool *pool) {
+	if(zsp == NULL)
+		return -1;
 
-	if(zs == NULL)
+	if(zsp->finalized != 0)
 		return -1;
 
-	if(zs->finalized == 1)
+	zsp->pool = pool;
+
+	return 0;
+}
+
+// Read stored entries from a memory mapping. Sources must not shrink while
+// they are read: a size change is noticed before every copy and CRC32 chunk
+// and fails the read, a truncation in the middle of one still raises SIGBUS.
+int zs_plan_set_mmap(ZSPlan *zsp, int enable) {
+	if(zsp == NULL)
 		return -1;
 
-	if(level < ZS_COMPRESS_LEVEL_DEFAULT || level > ZS_COMPRESS_LEVEL_SIZE)
-		level = ZS_COMPRESS_LEVEL_DEFAULT;
+	if(zsp->finalized != 0)
+		return -1;
 
-	switch(compression) {
-		case ZS_COMPRESS_NONE:
-			break;
-#ifdef WITH_DEFLATE
-		case ZS_COMPRESS_DEFLATE:
-			if(level == ZS_COMPRESS_LEVEL_SPEED)
-				level = Z_BEST_SPEED;
-			else if(level == ZS_COMPRESS_LEVEL_SIZE)
-				level = Z_BEST_COMPRESSION;
-			else
-				level = Z_DEFAULT_COMPRESSION;
+	zsp->mmap = (enable != 0) ? 1 : 0;
 
-			break;
-#endif
-#ifdef WITH_BZIP2
-		case ZS_COMPRESS_BZIP2:
-			if(level == ZS_COMPRESS_LEVEL_SPEED)
-				level = 1;
-			else if(level == ZS_COMPRESS_LEVEL_SIZE)
-				level = 9;
-			else
-				level = 6;
+	return 0;
+}
 
-			break;
+// Take compressor contexts from a pool shared with other plans, subject to
+// its memory budget. Not with zs_plan_set_pbzip2().
+int zs_plan_set_codecs(ZSPlan *zsp, ZSCodecPool *codecs) {
+	if(zsp == NULL)
+		return -1;
+
+	if(zsp->finalized != 0)
+		return -1;
+
+#ifdef WITH_BZIP2
+	if(codecs != NULL && zsp->pbzip2 != 0)
+		return -1;
 #endif
-		default:
+
+	zsp->codecs = codecs;
+
+	return 0;
+}
+
+// Keep the entries as compact records (front coded names, packed fields)
+// instead of ZSFile structures. Source paths of the form basedir/targetpath
+// aren't stored at all. With spill the records are kept in a temporary file,
+// and so are the central directory values of every reader, such that memory
+// stays flat regardless of the number of entries. Only before the first
+// entry is added. Encryption, zs_plan_layout() and zs_read_range() are not
+// available then. Neither is ZIP64, like for any plan: zs_plan_add_file()
+// returns -1 past 65534 entries, and zs_read() fails once an entry or the
+// archive reaches 4 GiB.
+int zs_plan_set_compact(ZSPlan *zsp, const char *basedir, int spill) {
+	if(zsp == NULL)
+		return -1;
+
+	if(zsp->finalized != 0 || zsp->zsd.nfiles != 0 || zsp->compact.enabled == 1 || zsp->dedup.mode != 0)
+		return -1;
+
+	if(basedir != NULL) {
+		zsp->compact.basedir = strdup(basedir);
+		if(zsp->compact.basedir == NULL)
 			return -1;
 	}
 
-	if(stat(sourcepath, &sb) == -1)
+	if(zs_store_init(&zsp->compact.store, spill) != 0) {
+		free(zsp->compact.basedir);
+		zsp->compact.basedir = NULL;
+
 		return -1;
+	}
 
-	if(!S_ISREG(sb.st_mode))
+	zsp->compact.enabled = 1;
+
+	return 0;
+}
+
+// Compress identical files only once per archive. Duplicates are found when
+// entries are added, by device and inode (ZS_DEDUP_INODE) and/or by size,
+// CRC32 and a byte for byte comparison (ZS_DEDUP_CONTENT), for entries with the
+// same method and level. Every reader keeps the output of the first entry of
+// a group, in memory or with ZS_DEDUP_SPILL in a temporary file, and replays it
+// for the others. Once budget bytes (0: unlimited) are kept, entries are
+// compressed again. Only before the first entry is added, not for compact plans.
+int zs_plan_set_dedup(ZSPlan *zsp, int mode, size_t budget) {
+	if(zsp == NULL)
 		return -1;
 
-	zsf = (ZSFile *)calloc(1, sizeof(ZSFile));
-	if(zsf == NULL)
+	if(zsp->finalized != 0 || zsp->zsd.nfiles != 0 || zsp->compact.enabled == 1)
 		return -1;
 
-	zsf->fpath = strdup(sourcepath);
-	if(zsf->fpath == NULL) {
-		free(zsf);
+	if(!(mode & (ZS_DEDUP_INODE | ZS_DEDUP_CONTENT)))
+		return -1;
+
+	zsp->dedup.mode = mode;
+	zsp->dedup.budget = budget;
+
+	return 0;
+}
+
+// Files up to size bytes are read with one call and compressed in one go
+// before their local header, which then carries the CRC32 and sizes, such
+// that no data descriptor follows. Only before the first entry is added.
+int zs_plan_set_small(ZSPlan *zsp, size_t size) {
+	if(zsp == NULL)
+		return -1;
+
+	if(zsp->finalized != 0 || zsp->zsd.nfiles != 0)
+		return -1;
+
+	zsp->small = size;
+
+	return 0;
+}
+
+// Give all entries the same time, e.g. SOURCE_DATE_EPOCH, converted in UTC
+// instead of the local time zone. Before the first entry.
+int zs_plan_set_time(ZSPlan *zsp, time_t t) {
+	struct tm tm;
+
+	if(zsp == NULL)
+		return -1;
+
+	if(zsp->finalized != 0 || zsp->zsd.nfiles != 0)
+		return -1;
+
+	if(gmtime_r(&t, &tm) == NULL || tm.tm_year < 80 || tm.tm_year > 207)
+		return -1;
+
+	zsp->dostime = zs_dostime_tm(&tm);
+
+	return 0;
+}
+
+#ifdef WITH_BZIP2
+// Compress the blocks of bzip2 entries in parallel on the plan's pool, with
+// up to blocks of them in flight per cursor (0 disables it). The output is a
+// single bzip2 stream, like the one of a single compressor. The blocks have
+// contexts of their own, which a codec pool's budget wouldn't cover, so not
+// with zs_plan_set_codecs().
+int zs_plan_set_pbzip2(ZSPlan *zsp, int blocks) {
+	if(zsp == NULL || blocks < 0)
+		return -1;
+
+	if(zsp->finalized != 0)
+		return -1;
+
+	if(blocks != 0 && zsp->codecs != NULL)
+		return -1;
 
+	zsp->pbzip2 = blocks;
+
+	return 0;
+}
+#endif
+
+#ifdef WITH_DIGEST
+// Compute digests (ZS_DIGEST_*) of the uncompressed data of every entry while
+// it is read. Readers hand them to their callback (zs_set_digest_callback())
+// and, if manifest is set, add a stored member of that name at the end of the
+// archive, with a "SHA256 (name) = hex" line per entry and digest. Copied
+// entries have no digests. zs_plan_layout() isn't available with a manifest.
+int zs_plan_set_digests(ZSPlan *zsp, int digests, const char *manifest) {
+	if(zsp == NULL)
+		return -1;
+
+	if(zsp->finalized != 0)
+		return -1;
+
+	if(!(digests & (ZS_DIGEST_SHA256 | ZS_DIGEST_BLAKE2B)))
 		return -1;
+
+	free(zsp->digest.manifest);
+	zsp->digest.manifest = NULL;
+
+	if(manifest != NULL) {
+		zsp->digest.manifest = strdup(manifest);
+		if(zsp->digest.manifest == NULL)
+			return -1;
 	}
 
-	zsf->fname = strdup(targetpath);
-	if(zsf->fname == NULL) {
-		free(zsf->fpath);
-		free(zsf);
+	zsp->digest.digests = digests;
+
+	return 0;
+}
+
+// The manifest member, its data is produced by every reader
+static int zs_plan_add_manifest(ZSPlan *zsp) {
+	ZSFile *zsf;
+
+	zsf = (ZSFile *)calloc(1, sizeof(ZSFile));
+	if(zsf == NULL)
+		return -1;
+
+	zsf->fpath = strdup("");
+	zsf->fname = strdup(zsp->digest.manifest);
+	if(zsf->fpath == NULL || zsf->fname == NULL) {
+		zs_file_free(zsf);
 
 		return -1;
 	}
 
 	zsf->lfname = strlen(zsf->fname);
 
-	zsf->ftime = sb.st_mtime;
-	zsf->fsize = sb.st_size;
-	zsf->fsize_compressed = 0;
+	// The newest entry, the archive doesn't depend on when it was made
+	zsf->ftime = zsp->newest;
+	zsf->dostime = (zsf->ftime != 0) ? zs_dostime(zsf->ftime) : ZS_DOSTIME_MIN;
 
-	zsf->compression = compression;
-	switch(zsf->compression) {
-		case ZS_COMPRESS_NONE:
-			zsf->version = 10;
-			break;
-#ifdef WITH_DEFLATE
-		case ZS_COMPRESS_DEFLATE:
-			zsf->level = level;
-			zsf->version = 20;
-			break;
+	zsf->compression = ZS_COMPRESS_MANIFEST;
+	zsf->method = ZS_COMPRESS_NONE;
+	zsf->version = 10;
+	zsf->flags = ZS_FLAG_DESCRIPTOR;
+
+	return zs_plan_append(zsp, zsf);
+}
 #endif
-#ifdef WITH_BZIP2
-		case ZS_COMPRESS_BZIP2:
-			zsf->level = level;
-			zsf->version = 46;
-			break;
+
+// A failure is final, later calls return -1 as well instead of changing a
+// plan that other readers may already walk.
+int zs_plan_finalize(ZSPlan *zsp) {
+	ZSFile *zsf;
+
+	if(zsp == NULL)
+		return -1;
+
+	pthread_mutex_lock(&zsp->lock);
+
+	if(zsp->finalized == 0) {
+		zsp->finalized = -1;
+
+#ifdef WITH_DIGEST
+		if(zsp->digest.manifest != NULL && zs_plan_add_manifest(zsp) != 0) {
+			pthread_mutex_unlock(&zsp->lock);
+
+			return -1;
+		}
+#endif
+
+		for(zsf = zsp->zsd.files; zsf != NULL; zsf = zsf->next)
+			zs_prepare_lfh(zsf);
+
+		if(zsp->compact.enabled == 1 && zs_store_flush(&zsp->compact.store) != 0) {
+			pthread_mutex_unlock(&zsp->lock);
+
+			return -1;
+		}
+
+		zs_dedup_free(&zsp->dedup);
+
+		zsp->finalized = 1;
+	}
+
+	pthread_mutex_unlock(&zsp->lock);
+
+	return (zsp->finalized == 1) ? 0 : -1;
+}
+
+// Compute the offsets of all entries and of the central directory. The CRC32
+// of stored entries is computed here if no reader has cached it yet. Entries
+// that are compressed must have been read completely by a reader before.
+int zs_plan_layout(ZSPlan *zsp) {
+	ZSFile *zsf;
+	ZSFile **index;
+	size_t *cdindex;
+	size_t offset, cdsize;
+	unsigned long crc;
+	size_t fsize;
+	int i, layout;
+
+	if(zsp == NULL || zsp->compact.enabled == 1)
+		return -1;
+
+	if(zs_plan_finalize(zsp) != 0)
+		return -1;
+
+	pthread_mutex_lock(&zsp->lock);
+	layout = zsp->layout;
+	pthread_mutex_unlock(&zsp->lock);
+
+	if(layout == 1)
+		return 0;
+
+	for(zsf = zsp->zsd.files; zsf != NULL; zsf = zsf->next) {
+		pthread_mutex_lock(&zsp->lock);
+		layout = zsf->cached;
+		pthread_mutex_unlock(&zsp->lock);
+
+		if(zsf->compression == ZS_COMPRESS_MANIFEST)
+			return -1;
+
+		if(layout == 1)
+			continue;
+
+		if(zsf->method != ZS_COMPRESS_NONE)
+			return -1;
+
+		if(zs_crc_file((zsp->mmap == 1) ? zsp->pool : NULL, zsf->fpath, &crc, &fsize) != 0)
+			return -1;
+
+		pthread_mutex_lock(&zsp->lock);
+		if(zsf->cached == 0) {
+			zsf->crc32 = crc;
+			zsf->fsize = fsize;
+			zsf->fsize_compressed = fsize;
+			zsf->cached = 1;
+		}
+		pthread_mutex_unlock(&zsp->lock);
+	}
+
+	index = (ZSFile **)calloc(zsp->zsd.nfiles + 1, sizeof(ZSFile *));
+	cdindex = (size_t *)calloc(zsp->zsd.nfiles + 1, sizeof(size_t));
+	if(index == NULL || cdindex == NULL) {
+		free(index);
+		free(cdindex);
+
+		return -1;
+	}
+
+	pthread_mutex_lock(&zsp->lock);
+
+	if(zsp->layout == 1) {
+		pthread_mutex_unlock(&zsp->lock);
+
+		free(index);
+		free(cdindex);
+
+		return 0;
+	}
+
+	offset = 0;
+	cdsize = 0;
+
+	for(i = 0, zsf = zsp->zsd.files; zsf != NULL; i++, zsf = zsf->next) {
+		// Readers don't lock to read placed offsets
+		if(zsf->placed == 0) {
+			zsf->offset = offset;
+			zsf->placed = 1;
+		}
+
+		offset += ZS_LENGTH_LFH;
+		offset += zsf->lfname + zsf->lextra;
+		offset += zsf->fsize_compressed;
+		offset += zs_get_lfdsize(zsf);
+
+		index[i] = zsf;
+		cdindex[i] = cdsize;
+
+		cdsize += ZS_LENGTH_CDH;
+		cdsize += zsf->lfname + zsf->lextra;
+	}
+
+	if(offset > ZS_MAX_SIZE || cdsize > ZS_MAX_SIZE) {
+		pthread_mutex_unlock(&zsp->lock);
+
+		free(index);
+		free(cdindex);
+
+		return -1;
+	}
+
+	zsp->index = index;
+	zsp->cdindex = cdindex;
+
+	zsp->cdoffset = offset;
+	zsp->cdsize = cdsize;
+	zsp->size = offset + cdsize + ZS_LENGTH_EOCD;
+
+	zsp->layout = 1;
+
+	pthread_mutex_unlock(&zsp->lock);
+
+	return 0;
+}
+
+void zs_init(ZS *zs) {
+	if(zs == NULL)
+		return;
+
+	memset(zs, 0, sizeof(ZS));
+
+	return;
+}
+
+int zs_open(ZS *zs, ZSPlan *zsp) {
+	if(zs == NULL || zsp == NULL)
+		return -1;
+
+	zs_init(zs);
+
+	zs->zsp = zs_plan_ref(zsp);
+
+	return 0;
+}
+
+void zs_free(ZS *zs) {
+	if(zs == NULL)
+		return;
+
+	if(zs->fp != NULL)
+		fclose(zs->fp);
+
+	zs_map_close(zs);
+
+	zs_codec_release(zs);
+	zs_codec_free(zs->spare);
+
+#ifdef WITH_BZIP2
+	zs_pbzip2_free(&zs->bzip2.parallel);
+#endif
+
+#ifdef WITH_AES
+	if(zs->aes.init == 1)
+		zs_aes_free(&zs->aes.ctx);
+
+	zs_aes_key_clear(&zs->aes.key);
+#endif
+
+	free(zs->small.in);
+	free(zs->small.out);
+
+	free(zs->out.data);
+	free(zs->entries);
+
+	if(zs->compact.init == 1) {
+		zs_store_reader_free(&zs->compact.reader);
+		zs_store_names_free(&zs->compact.names);
+
+		zs_store_free(&zs->compact.cd);
+		zs_store_reader_free(&zs->compact.cdreader);
+	}
+
+	if(zs->dedup.init == 1) {
+		zs_store_free(&zs->dedup.store);
+		free(zs->dedup.slots);
+	}
+
+#ifdef WITH_DIGEST
+	if(zs->digest.init == 1) {
+		zs_digest_free(&zs->digest.ctx);
+		zs_store_free(&zs->digest.manifest);
+	}
+#endif
+
+	zs_plan_unref(zs->zsp);
+
+	zs_init(zs);
+
+	return;
+}
+
+int zs_add_file(ZS *zs, const char *targetpath, const char *sourcepath, int compression, int level) {
+	if(zs == NULL)
+		return -1;
+
+	if(zs->stage != NONE)
+		return -1;
+
+	if(zs->zsp == NULL) {
+		zs->zsp = zs_plan_new();
+		if(zs->zsp == NULL)
+			return -1;
+	}
+
+	return zs_plan_add_file(zs->zsp, targetpath, sourcepath, compression, level);
+}
+
+int zs_add_from_zip(ZS *zs, const char *archivepath, const char *pattern) {
+	if(zs == NULL)
+		return -1;
+
+	if(zs->stage != NONE)
+		return -1;
+
+	if(zs->zsp == NULL) {
+		zs->zsp = zs_plan_new();
+		if(zs->zsp == NULL)
+			return -1;
+	}
+
+	return zs_plan_add_from_zip(zs->zsp, archivepath, pattern);
+}
+
+#ifdef WITH_AES
+int zs_add_file_aes(ZS *zs, const char *targetpath, const char *sourcepath, int compression, int level, const char *password) {
+	if(zs == NULL)
+		return -1;
+
+	if(zs->stage != NONE)
+		return -1;
+
+	if(zs->zsp == NULL) {
+		zs->zsp = zs_plan_new();
+		if(zs->zsp == NULL)
+			return -1;
+	}
+
+	return zs_plan_add_file_aes(zs->zsp, targetpath, sourcepath, compression, level, password);
+}
+#endif
+
+int zs_plan_add_file(ZSPlan *zsp, const char *targetpath, const char *sourcepath, int compression, int level) {
+	ZSFile *zsf;
+
+	zsf = zs_file_new(targetpath, sourcepath, compression, level);
+	if(zsf == NULL)
+		return -1;
+
+	return zs_plan_append(zsp, zsf);
+}
+
+#ifdef WITH_AES
+// WinZip AES-256 (AE-2). The plan keeps the password, every reader derives
+// the keys of the entry with a salt of its own.
+int zs_plan_add_file_aes(ZSPlan *zsp, const char *targetpath, const char *sourcepath, int compression, int level, const char *password) {
+	ZSFile *zsf;
+
+	if(zsp == NULL || password == NULL)
+		return -1;
+
+	// The keys don't fit into compact records
+	if(zsp->compact.enabled == 1)
+		return -1;
+
+	zsf = zs_file_new(targetpath, sourcepath, compression, level);
+	if(zsf == NULL)
+		return -1;
+
+	zsf->aes = zs_aes_secret_new(password);
+	if(zsf->aes == NULL) {
+		zs_file_free(zsf);
+
+		return -1;
+	}
+
+	zsf->version = 51;
+	zsf->method = ZS_METHOD_AES;
+	zsf->flags |= ZS_FLAG_ENCRYPTED;
+
+	zsp->encrypted = 1;
+
+	// AES extra data record
+	zsf->extra[ 0] = 0x01;
+	zsf->extra[ 1] = 0x99;
+	zsf->extra[ 2] = 0x07;	// Data size
+	zsf->extra[ 3] = 0x00;
+	zsf->extra[ 4] = 0x02;	// Vendor version AE-2
+	zsf->extra[ 5] = 0x00;
+	zsf->extra[ 6] = 'A';
+	zsf->extra[ 7] = 'E';
+	zsf->extra[ 8] = 0x03;	// AES-256
+	zsf->extra[ 9] = ((zsf->compression >>  0) & 0xFF);
+	zsf->extra[10] = ((zsf->compression >>  8) & 0xFF);
+	zsf->lextra = ZS_LENGTH_AES_EXTRA;
+
+	return zs_plan_append(zsp, zsf);
+}
+#endif
+
+// Copy the members of another archive that match pattern (fnmatch(3), NULL for
+// all) without recompressing them. CRC32, sizes, method and time are taken from
+// its central directory. Returns the number of members added. All members are
+// read before the first is added, such that a damaged archive leaves the plan
+// as it was. Only if appending fails (out of memory, compact store) the members
+// before stay in the plan.
+int zs_plan_add_from_zip(ZSPlan *zsp, const char *archivepath, const char *pattern) {
+	ZSUnzipDirectory zud;
+	ZSUnzipEntry *entry;
+	ZSFile **members, *zsf;
+	size_t offset;
+	int n, i, nmembers;
+
+	if(zsp == NULL || archivepath == NULL)
+		return -1;
+
+	if(zsp->finalized != 0)
+		return -1;
+
+	if(zs_unzip_directory(&zud, archivepath) != 0)
+		return -1;
+
+	members = (ZSFile **)calloc(zud.nentries + 1, sizeof(ZSFile *));
+	if(members == NULL) {
+		zs_unzip_directory_free(&zud);
+
+		return -1;
+	}
+
+	nmembers = 0;
+
+	for(n = 0; n < zud.nentries; n++) {
+		entry = &zud.entries[n];
+
+		if(pattern != NULL && fnmatch(pattern, entry->name, 0) != 0)
+			continue;
+
+		// The encryption headers are in the local extra field
+		if(entry->flags & ZS_FLAG_ENCRYPTED)
+			continue;
+
+		if(zs_unzip_data_offset(&zud, entry, &offset) != 0)
+			goto error;
+
+		zsf = (ZSFile *)calloc(1, sizeof(ZSFile));
+		if(zsf == NULL)
+			goto error;
+
+		zsf->fpath = strdup(archivepath);
+		zsf->fname = strdup(entry->name);
+		if(zsf->fpath == NULL || zsf->fname == NULL) {
+			free(zsf->fpath);
+			free(zsf->fname);
+			free(zsf);
+
+			goto error;
+		}
+
+		zsf->lfname = entry->lname;
+
+		zsf->dostime = entry->dostime;
+
+		zsf->compression = ZS_COMPRESS_RAW;
+		zsf->method = entry->method;
+		zsf->version = entry->version;
+
+		// Keep the compression option and UTF-8 bits
+		zsf->flags = ZS_FLAG_DESCRIPTOR | (entry->flags & 0x0806);
+
+		zsf->raw_offset = offset;
+
+		zsf->crc32 = entry->crc32;
+		zsf->fsize = entry->fsize;
+		zsf->fsize_compressed = entry->fsize_compressed;
+		zsf->cached = 1;
+
+		members[nmembers++] = zsf;
+	}
+
+	zs_unzip_directory_free(&zud);
+
+	// zs_plan_append() takes the member, also if it fails
+	for(i = 0; i < nmembers; i++) {
+		if(zs_plan_append(zsp, members[i]) != 0) {
+			for(i++; i < nmembers; i++)
+				zs_file_free(members[i]);
+
+			free(members);
+
+			return -1;
+		}
+	}
+
+	free(members);
+
+	return nmembers;
+
+error:
+	for(i = 0; i < nmembers; i++)
+		zs_file_free(members[i]);
+
+	free(members);
+
+	zs_unzip_directory_free(&zud);
+
+	return -1;
+}
+
+ZSFile *zs_file_new(const char *targetpath, const char *sourcepath, int compression, int level) {
+	ZSFile *zsf;
+	struct stat sb;
+
+	if(level < ZS_COMPRESS_LEVEL_DEFAULT || level > ZS_COMPRESS_LEVEL_SIZE)
+		level = ZS_COMPRESS_LEVEL_DEFAULT;
+
+	switch(compression) {
+		case ZS_COMPRESS_NONE:
+			break;
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			if(level == ZS_COMPRESS_LEVEL_SPEED)
+				level = Z_BEST_SPEED;
+			else if(level == ZS_COMPRESS_LEVEL_SIZE)
+				level = Z_BEST_COMPRESSION;
+			else
+				level = Z_DEFAULT_COMPRESSION;
+
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			if(level == ZS_COMPRESS_LEVEL_SPEED)
+				level = 1;
+			else if(level == ZS_COMPRESS_LEVEL_SIZE)
+				level = 9;
+			else
+				level = 6;
+
+			break;
+#endif
+		default:
+			return NULL;
+	}
+
+	if(stat(sourcepath, &sb) == -1)
+		return NULL;
+
+	if(!S_ISREG(sb.st_mode) || (unsigned long long)sb.st_size > ZS_MAX_SIZE)
+		return NULL;
+
+	zsf = (ZSFile *)calloc(1, sizeof(ZSFile));
+	if(zsf == NULL)
+		return NULL;
+
+	zsf->fpath = strdup(sourcepath);
+	if(zsf->fpath == NULL) {
+		free(zsf);
+
+		return NULL;
+	}
+
+	zsf->fname = strdup(targetpath);
+	if(zsf->fname == NULL) {
+		free(zsf->fpath);
+		free(zsf);
+
+		return NULL;
+	}
+
+	zsf->lfname = strlen(zsf->fname);
+
+	zsf->dev = sb.st_dev;
+	zsf->ino = sb.st_ino;
+
+	zsf->ftime = sb.st_mtime;
+	zsf->dostime = zs_dostime(zsf->ftime);
+	zsf->fsize = sb.st_size;
+	zsf->fsize_compressed = 0;
+
+	zsf->compression = compression;
+	zsf->method = compression;
+	zsf->flags = ZS_FLAG_DESCRIPTOR;
+	switch(zsf->compression) {
+		case ZS_COMPRESS_NONE:
+			zsf->version = 10;
+			break;
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			zsf->level = level;
+			zsf->version = 20;
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			zsf->level = level;
+			zsf->version = 46;
+			break;
+#endif
+	}
+
+	return zsf;
+}
+
+void zs_file_free(ZSFile *zsf) {
+	if(zsf == NULL)
+		return;
+
+	free(zsf->fpath);
+	free(zsf->fname);
+#ifdef WITH_AES
+	zs_aes_secret_free(zsf->aes);
+#endif
+
+	free(zsf);
+
+	return;
+}
+
+// Takes over zsf, compact plans only keep its record
+int zs_plan_append(ZSPlan *zsp, ZSFile *zsf) {
+	ZSFingerprint fingerprint;
+	int rv = 0;
+
+	if(zsp == NULL || zsp->finalized != 0 || zsp->zsd.nfiles >= ZS_MAX_ENTRIES) {
+		zs_file_free(zsf);
+
+		return -1;
+	}
+
+	// Copied and encrypted entries keep the data descriptor
+	if(zsp->small != 0 && zsf->fsize <= zsp->small && zsf->compression != ZS_COMPRESS_RAW && zsf->compression != ZS_COMPRESS_MANIFEST && !(zsf->flags & ZS_FLAG_ENCRYPTED))
+		zsf->flags &= ~ZS_FLAG_DESCRIPTOR;
+
+	if(zsp->dostime != 0)
+		zsf->dostime = zsp->dostime;
+
+	fingerprint = zsp->fingerprint;
+	zs_plan_fingerprint(&fingerprint, zsf);
+
+	if(zsf->ftime > zsp->newest)
+		zsp->newest = zsf->ftime;
+
+	if(zsp->compact.enabled == 1) {
+		rv = zs_store_encode(&zsp->compact.store, &zsp->compact.names, zsp->compact.basedir, zsf);
+		zs_file_free(zsf);
+
+		if(rv != 0)
+			return -1;
+	}
+	else if(zsp->dedup.mode != 0 && zs_dedup_add(&zsp->dedup, zsf) != 0) {
+		zs_file_free(zsf);
+
+		return -1;
+	}
+	else if(zsp->zsd.last != NULL) {
+		zsp->zsd.last->next = zsf;
+		zsf->prev = zsp->zsd.last;
+
+		zsp->zsd.last = zsf;
+	}
+	else {
+		zsp->zsd.files = zsf;
+		zsp->zsd.last = zsf;
+	}
+
+	zsp->zsd.nfiles++;
+
+	zsp->fingerprint = fingerprint;
+
+	return 0;
+}
+
+// Everything about an entry that goes into the archive, or that identifies
+// its source
+void zs_plan_fingerprint(ZSFingerprint *fp, ZSFile *zsf) {
+	zs_fingerprint_string(fp, zsf->fname);
+	zs_fingerprint_string(fp, zsf->fpath);
+
+	zs_fingerprint_value(fp, zsf->ftime);
+	zs_fingerprint_value(fp, zsf->dev);
+	zs_fingerprint_value(fp, zsf->ino);
+	zs_fingerprint_value(fp, zsf->fsize);
+	zs_fingerprint_value(fp, zsf->dostime);
+
+	zs_fingerprint_value(fp, zsf->compression);
+	zs_fingerprint_value(fp, zsf->level);
+	zs_fingerprint_value(fp, zsf->method);
+	zs_fingerprint_value(fp, zsf->flags);
+	zs_fingerprint_value(fp, zsf->version);
+
+	// Copied entries
+	zs_fingerprint_value(fp, zsf->raw_offset);
+	zs_fingerprint_value(fp, zsf->crc32);
+	zs_fingerprint_value(fp, zsf->fsize_compressed);
+
+	zs_fingerprint_value(fp, zsf->lextra);
+	zs_fingerprint_update(fp, zsf->extra, zsf->lextra);
+
+	return;
+}
+
+// Strong ETag of the archive, known before any data is produced: 32 hex
+// digits from the entries as they were added (names, source path, inode,
+// modification time, size, method, level, flags, time in the headers) and
+// the versions of the compression libraries. Finalizes the plan. Returns -1
+// for plans with encrypted entries, their salts are random. Changes of a
+// source file that keep its size and modification time go unnoticed. Cursors
+// with zs_set_adaptive() produce other bytes from the same plan and must not
+// be served under this ETag, or range requests mix different archives.
+int zs_fingerprint(ZSPlan *zsp, char *buf, size_t sbuf) {
+	ZSFingerprint fp;
+	unsigned char value[ZS_FINGERPRINT_LENGTH];
+	int i;
+
+	if(zsp == NULL || buf == NULL || sbuf < 2 * ZS_FINGERPRINT_LENGTH + 1)
+		return -1;
+
+	if(zs_plan_finalize(zsp) != 0)
+		return -1;
+
+	if(zsp->encrypted == 1)
+		return -1;
+
+	fp = zsp->fingerprint;
+
+	zs_fingerprint_value(&fp, ZS_FINGERPRINT_VERSION);
+	zs_fingerprint_value(&fp, zsp->zsd.nfiles);
+#ifdef WITH_DEFLATE
+	zs_fingerprint_string(&fp, zlibVersion());
+#endif
+#ifdef WITH_BZIP2
+	zs_fingerprint_string(&fp, BZ2_bzlibVersion());
+#endif
+
+	zs_fingerprint_finish(&fp, value);
+
+	for(i = 0; i < ZS_FINGERPRINT_LENGTH; i++)
+		snprintf(&buf[2 * i], 3, "%02x", value[i]);
+
+	return 0;
+}
+
+// Size of the output staging buffer, 0 disables it. Only before the first read.
+int zs_set_buffer(ZS *zs, int size) {
+	if(zs == NULL || size < 0)
+		return -1;
+
+	if(zs->stage != NONE)
+		return -1;
+
+	zs->out.size = (size == 0) ? -1 : size;
+
+	return 0;
+}
+
+// Adapt the deflate level to the consumer. Between blocks the level is moved
+// by one step, such that the codec processes at least rate bytes per second
+// of its own time and takes at most cpu percent of the wall time, i.e. stays
+// just ahead of the consumer. 0 disables either limit. Only before the first
+// read. The output then differs from other readers of the plan. Not for plans
+// with encrypted entries: different plaintext would then only be kept apart
+// by the salt of the reader.
+int zs_set_adaptive(ZS *zs, size_t rate, int cpu) {
+	if(zs == NULL || cpu < 0 || cpu > 100)
+		return -1;
+
+	if(zs->stage != NONE)
+		return -1;
+
+	if(zs->zsp != NULL && zs->zsp->encrypted == 1)
+		return -1;
+
+	if(rate == 0 && cpu == 0)
+		return -1;
+
+	zs->adapt.enabled = 1;
+	zs->adapt.rate = rate;
+	zs->adapt.cpu = cpu;
+
+	return 0;
+}
+
+#ifdef WITH_DIGEST
+// Called with the name and digests of every entry as soon as its data has
+// been read, in archive order. Only before the first read.
+int zs_set_digest_callback(ZS *zs, void (*fn)(void *arg, const char *name, const ZSDigest *digest), void *arg) {
+	if(zs == NULL)
+		return -1;
+
+	if(zs->stage != NONE)
+		return -1;
+
+	zs->digest.fn = fn;
+	zs->digest.arg = arg;
+
+	return 0;
+}
+#endif
+
+int zs_read(ZS *zs, char *buf, int sbuf) {
+	int bytes;
+
+	if(zs == NULL)
+		return -1;
+
+	if(zs->zsp == NULL) {
+		zs->zsp = zs_plan_new();
+		if(zs->zsp == NULL)
+			return -1;
+	}
+
+	if(zs->stage == NONE) {
+		if(zs_plan_finalize(zs->zsp) != 0)
+			return -1;
+
+		if(zs->zsp->compact.enabled == 1 && zs->compact.init == 0) {
+			if(zs_store_init(&zs->compact.cd, zs->zsp->compact.store.fd != -1) != 0)
+				return -1;
+
+			zs->compact.init = 1;
+		}
+		else if(zs->adapt.enabled == 1 && zs->entries == NULL) {
+			// Entries may have been added after zs_set_adaptive()
+			if(zs->zsp->encrypted == 1)
+				return -1;
+
+			zs->entries = (ZSEntry *)calloc(zs->zsp->zsd.nfiles + 1, sizeof(ZSEntry));
+			if(zs->entries == NULL)
+				return -1;
+		}
+
+		if(zs->zsp->dedup.groups != 0 && zs->dedup.init == 0) {
+			if(zs_store_init(&zs->dedup.store, (zs->zsp->dedup.mode & ZS_DEDUP_SPILL) ? 1 : 0) != 0)
+				return -1;
+
+			zs->dedup.slots = (ZSDedupSlot *)calloc(zs->zsp->dedup.groups + 1, sizeof(ZSDedupSlot));
+			if(zs->dedup.slots == NULL) {
+				zs_store_free(&zs->dedup.store);
+
+				return -1;
+			}
+
+			zs->dedup.init = 1;
+		}
+
+#ifdef WITH_DIGEST
+		if(zs->zsp->digest.digests != 0 && zs->digest.init == 0) {
+			if(zs_digest_init(&zs->digest.ctx, zs->zsp->digest.digests) != 0)
+				return -1;
+
+			if(zs_store_init(&zs->digest.manifest, zs->zsp->compact.enabled == 1 && zs->zsp->compact.store.fd != -1) != 0) {
+				zs_digest_free(&zs->digest.ctx);
+
+				return -1;
+			}
+
+			zs->digest.init = 1;
+		}
+#endif
+	}
+
+	bytes = 0;
+
+	do {
+		zs_stager(zs);
+
+		if(zs->stage == ERROR)
+			return -1;
+
+		// Hand out what we have, the caller retries later
+		if(zs->again == 1) {
+			zs->again = 0;
+
+			return (bytes != 0) ? bytes : ZSE_AGAIN;
+		}
+
+		if(zs->stage == FIN)
+			return bytes;
+
+		switch(zs->stage) {
+			case LF_HEADER:
+				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_LFH);
+				break;
+			case LF_DESCRIPTOR:
+				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_LFD);
+				break;
+			case CD_HEADER:
+				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_CDH);
+				break;
+			case EOCD:
+				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_EOCD);
+				break;
+			case LF_NAME:
+			case CD_NAME:
+				bytes += zs_write_filename(zs, &buf[bytes], sbuf - bytes);
+				break;
+			case LF_DATA:
+				bytes += zs_write_filedata(zs, &buf[bytes], sbuf - bytes);
+				break;
+			default:
+				return -1;
+		}
+	} while(bytes != sbuf);
+
+	return bytes;
+}
+
+// Produce len bytes of the archive starting at offset, without a cursor.
+// Stored or copied entries only: the data of compressed and encrypted entries
+// is never served, also if it is cached, a range reaching it returns -1. Can
+// be called from any number of threads at the same time.
+int zs_read_range(ZSPlan *zsp, size_t offset, int len, char *buf) {
+	ZS zs;
+	ZSFile *zsf;
+	size_t pos, rel;
+	int bytes, lo, hi, mid, n;
+
+	if(zsp == NULL || buf == NULL || len < 0)
+		return -1;
+
+	if(zs_plan_layout(zsp) != 0)
+		return -1;
+
+	if(offset >= zsp->size)
+		return 0;
+
+	if((size_t)len > zsp->size - offset)
+		len = zsp->size - offset;
+
+	// Scratch cursor for the header builders
+	zs_init(&zs);
+	zs.zsp = zsp;
+
+	bytes = 0;
+
+	while(bytes < len) {
+		pos = offset + bytes;
+
+		if(pos < zsp->cdoffset) {
+			lo = 0;
+			hi = zsp->zsd.nfiles - 1;
+
+			while(lo < hi) {
+				mid = (lo + hi + 1) / 2;
+
+				if(zsp->index[mid]->offset <= pos)
+					lo = mid;
+				else
+					hi = mid - 1;
+			}
+
+			zsf = zsp->index[lo];
+			rel = pos - zsf->offset;
+
+			zs.zsf = zsf;
+			zs.crc32 = zsf->crc32;
+			zs.fsize = zsf->fsize;
+			zs.fsize_compressed = zsf->fsize_compressed;
+
+			if(rel < ZS_LENGTH_LFH) {
+				zs_build_lfh(&zs);
+				n = zs_range_copy(&buf[bytes], len - bytes, zs.stage_data, ZS_LENGTH_LFH, rel);
+			}
+			else if((rel -= ZS_LENGTH_LFH) < zsf->lfname + zsf->lextra)
+				n = zs_range_name(&buf[bytes], len - bytes, zsf, rel);
+			else if((rel -= zsf->lfname + zsf->lextra) < zsf->fsize_compressed) {
+				if(zsf->compression == ZS_COMPRESS_RAW)
+					n = zs_range_pread(&buf[bytes], len - bytes, zsf->fpath, zsf->raw_offset + zsf->fsize_compressed, zsf->raw_offset + rel);
+				else if(zsf->method == ZS_COMPRESS_NONE)
+					n = zs_range_pread(&buf[bytes], len - bytes, zsf->fpath, zsf->fsize_compressed, rel);
+				else
+					return -1;
+
+				if(n <= 0)
+					return -1;
+			}
+			else {
+				zs_build_lfd(&zs);
+				n = zs_range_copy(&buf[bytes], len - bytes, zs.stage_data, ZS_LENGTH_LFD, rel - zsf->fsize_compressed);
+			}
+		}
+		else if(pos < zsp->cdoffset + zsp->cdsize) {
+			rel = pos - zsp->cdoffset;
+
+			lo = 0;
+			hi = zsp->zsd.nfiles - 1;
+
+			while(lo < hi) {
+				mid = (lo + hi + 1) / 2;
+
+				if(zsp->cdindex[mid] <= rel)
+					lo = mid;
+				else
+					hi = mid - 1;
+			}
+
+			zsf = zsp->index[lo];
+			rel -= zsp->cdindex[lo];
+
+			zs.zsf = zsf;
+
+			if(rel < ZS_LENGTH_CDH) {
+				zs_build_cdh(&zs);
+				n = zs_range_copy(&buf[bytes], len - bytes, zs.stage_data, ZS_LENGTH_CDH, rel);
+			}
+			else
+				n = zs_range_name(&buf[bytes], len - bytes, zsf, rel - ZS_LENGTH_CDH);
+		}
+		else {
+			zs_build_eocd(&zs);
+			n = zs_range_copy(&buf[bytes], len - bytes, zs.stage_data, ZS_LENGTH_EOCD, pos - zsp->cdoffset - zsp->cdsize);
+		}
+
+		bytes += n;
+	}
+
+	return bytes;
+}
+
+int zs_range_copy(char *buf, int sbuf, const char *data, size_t size, size_t pos) {
+	int bytes;
+
+	bytes = size - pos;
+	if(sbuf < bytes)
+		bytes = sbuf;
+
+	memcpy(buf, &data[pos], bytes);
+
+	return bytes;
+}
+
+// Name, followed by the extra field
+int zs_range_name(char *buf, int sbuf, ZSFile *zsf, size_t pos) {
+	int bytes;
+
+	bytes = 0;
+
+	if(pos < zsf->lfname)
+		bytes += zs_range_copy(buf, sbuf, zsf->fname, zsf->lfname, pos);
+
+	if(pos + bytes >= zsf->lfname)
+		bytes += zs_range_copy(&buf[bytes], sbuf - bytes, zsf->extra, zsf->lextra, pos + bytes - zsf->lfname);
+
+	return bytes;
+}
+
+int zs_range_pread(char *buf, int sbuf, const char *path, size_t size, size_t pos) {
+	int fd;
+	int bytes;
+	ssize_t bytesread;
+
+	bytes = size - pos;
+	if(sbuf < bytes)
+		bytes = sbuf;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return -1;
+
+	sbuf = 0;
+
+	while(sbuf < bytes) {
+		bytesread = pread(fd, &buf[sbuf], bytes - sbuf, pos + sbuf);
+		if(bytesread <= 0)
+			break;
+
+		sbuf += bytesread;
+	}
+
+	close(fd);
+
+	if(sbuf != bytes)
+		return -1;
+
+	return bytes;
+}
+
+int zs_crc_file(ZSPool *pool, const char *path, unsigned long *crc, size_t *size) {
+	FILE *fp;
+	char buf[ZS_COMPRESS_BUFFER_DEFLATE * 16];
+	size_t bytesread;
+	struct stat sb;
+	void *data;
+	ZSCrc *parallel;
+	int fd, rv;
+
+	// Large files are mapped and their CRC32 computed on the pool. Without
+	// memory for the chunks they are read below.
+	if(pool != NULL) {
+		fd = open(path, O_RDONLY);
+		if(fd == -1)
+			return -1;
+
+		if(fstat(fd, &sb) == 0 && sb.st_size >= 2 * ZS_CRC_CHUNK) {
+			data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(data == MAP_FAILED) {
+				close(fd);
+
+				return -1;
+			}
+
+			madvise(data, sb.st_size, MADV_SEQUENTIAL);
+
+			parallel = zs_crc_parallel(pool, fd, data, sb.st_size);
+			if(parallel != NULL) {
+				rv = zs_crc_wait(parallel, crc);
+				*size = sb.st_size;
+
+				munmap(data, sb.st_size);
+				close(fd);
+
+				return rv;
+			}
+
+			munmap(data, sb.st_size);
+		}
+
+		close(fd);
+	}
+
+	fp = fopen(path, "rb");
+	if(fp == NULL)
+		return -1;
+
+	*crc = crc_start();
+	*size = 0;
+
+	while((bytesread = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		*crc = crc_partial(*crc, buf, bytesread);
+		*size += bytesread;
+	}
+
+	if(ferror(fp)) {
+		fclose(fp);
+
+		return -1;
+	}
+
+	fclose(fp);
+
+	*crc = crc_finish(*crc);
+
+	return 0;
+}
+
+// Start computing the CRC32 of data, the mapping of fd, in chunks on the pool.
+// Chunks that can't be queued, or all of them on a worker of the pool, are
+// computed right away. fd must stay open until zs_crc_wait().
+ZSCrc *zs_crc_parallel(ZSPool *pool, int fd, const char *data, size_t size) {
+	ZSCrc *crc;
+	int i;
+
+	crc = (ZSCrc *)calloc(1, sizeof(ZSCrc));
+	if(crc == NULL)
+		return NULL;
+
+	crc->nchunks = (size + ZS_CRC_CHUNK - 1) / ZS_CRC_CHUNK;
+	crc->fd = fd;
+	crc->size = size;
+
+	crc->chunks = (ZSCrcChunk *)calloc(crc->nchunks, sizeof(ZSCrcChunk));
+	if(crc->chunks == NULL) {
+		free(crc);
+
+		return NULL;
+	}
+
+	zs_wait_init(&crc->wait);
+	zs_wait_add(&crc->wait, crc->nchunks);
+
+	for(i = 0; i < crc->nchunks; i++) {
+		crc->chunks[i].crc = crc;
+		crc->chunks[i].data = &data[(size_t)i * ZS_CRC_CHUNK];
+		crc->chunks[i].size = (i == crc->nchunks - 1) ? size - (size_t)i * ZS_CRC_CHUNK : ZS_CRC_CHUNK;
+
+		zs_pool_run(pool, zs_crc_chunk, &crc->chunks[i]);
+	}
+
+	return crc;
+}
+
+void zs_crc_chunk(void *arg) {
+	ZSCrcChunk *chunk = (ZSCrcChunk *)arg;
+
+	if(zs_map_check(chunk->crc->fd, chunk->crc->size) == 0)
+		chunk->value = crc_finish(crc_partial(crc_start(), (const unsigned char *)chunk->data, chunk->size));
+	else
+		chunk->changed = 1;
+
+	zs_wait_done(&chunk->crc->wait);
+
+	return;
+}
+
+// Wait for all chunks and join them into the finished CRC32. Returns -1 if
+// the file changed its size, its chunks were skipped.
+int zs_crc_wait(ZSCrc *crc, unsigned long *value) {
+	int i, rv;
+
+	zs_wait(&crc->wait);
+
+	rv = crc->chunks[0].changed;
+	*value = crc->chunks[0].value;
+
+	for(i = 1; i < crc->nchunks; i++) {
+		rv |= crc->chunks[i].changed;
+		*value = crc_combine(*value, crc->chunks[i].value, crc->chunks[i].size);
+	}
+
+	zs_wait_destroy(&crc->wait);
+
+	free(crc->chunks);
+	free(crc);
+
+	return (rv != 0) ? -1 : 0;
+}
+
+int zs_write_stagedata(ZS *zs, char *buf, int sbuf, int size) {
+	int i;
+	int bytes, bytesread;
+
+	bytes = 0;
+
+	bytesread = size - zs->stage_pos;
+	if(sbuf < bytesread)
+		bytesread = sbuf;
+
+	for(i = 0; i < bytesread; i++) {
+		buf[bytes] = zs->stage_data[i + zs->stage_pos];
+
+		bytes++;
+	}
+
+	zs->stage_pos += bytesread;
+
+	return bytes;
+}
+
+int zs_write_filename(ZS *zs, char *buf, int sbuf) {
+	int bytes;
+
+	bytes = zs_range_name(buf, sbuf, zs->zsf, zs->stage_pos);
+
+	zs->stage_pos += bytes;
+
+	return bytes;
+}
+
+int zs_write_filedata(ZS *zs, char *buf, int sbuf) {
+	int bytes;
+
+	// Stored data goes straight into the caller's buffer
+	if(zs->out.size == -1 || zs->write_filedata == zs_write_filedata_none || zs->write_filedata == zs_write_filedata_mmap || zs->write_filedata == zs_write_filedata_raw || zs->write_filedata == zs_write_filedata_replay || zs->write_filedata == zs_write_filedata_small)
+		bytes = zs->write_filedata(zs, buf, sbuf);
+	else
+		bytes = zs_write_filedata_staged(zs, buf, sbuf);
+
+	if(zs->dedup.capture != NULL)
+		zs_dedup_capture(zs, buf, bytes);
+
+	return bytes;
+}
+
+int zs_write_filedata_staged(ZS *zs, char *buf, int sbuf) {
+	int bytes;
+
+	if(zs->out.data == NULL) {
+		if(zs->out.size == 0)
+			zs->out.size = ZS_OUTPUT_BUFFER;
+
+		zs->out.data = (char *)malloc(zs->out.size);
+		if(zs->out.data == NULL) {
+			zs->stage = ERROR;
+
+			return 0;
+		}
+	}
+
+	// Refill only when drained. The writer's completion is withheld from
+	// the stager until the caller got all of the staged data.
+	if(zs->out.pos == zs->out.len) {
+		zs->out.pos = 0;
+		zs->out.len = 0;
+
+		while(zs->out.completed == 0 && zs->out.len != zs->out.size && zs->stage != ERROR) {
+			zs->out.len += zs->write_filedata(zs, &zs->out.data[zs->out.len], zs->out.size - zs->out.len);
+
+			if(zs->completed == 1) {
+				zs->completed = 0;
+				zs->out.completed = 1;
+			}
+		}
+	}
+
+	bytes = zs_range_copy(buf, sbuf, zs->out.data, zs->out.len, zs->out.pos);
+	zs->out.pos += bytes;
+
+	if(zs->out.pos == zs->out.len && zs->out.completed == 1) {
+		zs->out.completed = 0;
+		zs->out.pos = 0;
+		zs->out.len = 0;
+
+		zs->completed = 1;
+	}
+
+	return bytes;
+}
+
+int zs_write_filedata_none(ZS *zs, char *buf, int sbuf) {
+	int bytesread;
+
+	bytesread = fread(buf, 1, sbuf, zs->fp);
+	zs->stage_pos += bytesread;
+
+	zs->crc32 = crc_partial(zs->crc32, buf, bytesread);
+	zs_digest_data(zs, buf, bytesread);
+
+	zs->fsize_compressed += bytesread;
+
+	if(ferror(zs->fp) || feof(zs->fp)) {	// ERROR or EOF
+		zs->fsize = zs->stage_pos;
+		zs->fsize_compressed = zs->stage_pos;
+
+		zs->completed = 1;
+	}
+
+	return bytesread;
+}
+
+int zs_write_filedata_mmap(ZS *zs, char *buf, int sbuf) {
+	int bytes;
+
+	if(zs_map_check(zs->map.fd, zs->map.size) != 0) {
+		zs->stage = ERROR;
+
+		return 0;
+	}
+
+	bytes = zs_range_copy(buf, sbuf, zs->map.data, zs->map.size, zs->stage_pos);
+
+	if(zs->map.inline_crc == 1)
+		zs->crc32 = crc_partial(zs->crc32, buf, bytes);
+
+	zs_digest_data(zs, buf, bytes);
+
+	zs->stage_pos += bytes;
+
+	if(zs->stage_pos == zs->map.size) {
+		if(zs->map.crc != NULL) {
+			if(zs_crc_wait(zs->map.crc, &zs->crc32) != 0)
+				zs->stage = ERROR;
+
+			zs->crc_final = 1;
+			zs->map.crc = NULL;
+		}
+
+		zs->fsize = zs->stage_pos;
+		zs->fsize_compressed = zs->stage_pos;
+
+		zs->completed = 1;
+	}
+
+	return bytes;
+}
+
+int zs_write_filedata_raw(ZS *zs, char *buf, int sbuf) {
+	int bytesread;
+
+	bytesread = zs->zsf->fsize_compressed - zs->stage_pos;
+	if(sbuf < bytesread)
+		bytesread = sbuf;
+
+	bytesread = fread(buf, 1, bytesread, zs->fp);
+	zs->stage_pos += bytesread;
+
+	if(zs->stage_pos == zs->zsf->fsize_compressed || ferror(zs->fp) || feof(zs->fp)) {
+		zs->crc32 = zs->zsf->crc32;
+		zs->crc_final = 1;
+
+		zs->fsize = zs->zsf->fsize;
+		zs->fsize_compressed = zs->stage_pos;
+
+		zs->completed = 1;
+	}
+
+	return bytesread;
+}
+
+// Output of an earlier identical entry
+int zs_write_filedata_replay(ZS *zs, char *buf, int sbuf) {
+	ZSDedupSlot *slot = zs->dedup.replay;
+	int bytes;
+
+	bytes = slot->len - zs->stage_pos;
+	if(sbuf < bytes)
+		bytes = sbuf;
+
+	bytes = zs_store_read(&zs->dedup.store, slot->pos + zs->stage_pos, buf, bytes);
+	if(bytes < 0) {
+		zs->stage = ERROR;
+
+		return 0;
+	}
+
+	zs->stage_pos += bytes;
+
+	if(zs->stage_pos == slot->len) {
+		zs->crc32 = slot->crc32;
+		zs->crc_final = 1;
+
+		zs->fsize = slot->fsize;
+		zs->fsize_compressed = slot->len;
+
+		zs->completed = 1;
+	}
+
+	return bytes;
+}
+
+// Small file, compressed before its local header
+int zs_write_filedata_small(ZS *zs, char *buf, int sbuf) {
+	int bytes;
+
+	bytes = zs_range_copy(buf, sbuf, zs->small.data, zs->small.len, zs->stage_pos);
+	zs->stage_pos += bytes;
+
+	if(zs->stage_pos == zs->small.len) {
+		zs->crc32 = zs->small.crc32;
+		zs->crc_final = 1;
+
+		zs->fsize = zs->small.fsize;
+		zs->fsize_compressed = zs->small.len;
+
+		zs->small.ready = 0;
+
+		zs->completed = 1;
+	}
+
+	return bytes;
+}
+
+#ifdef WITH_DIGEST
+// Digest manifest, complete once the other entries are read
+int zs_write_filedata_manifest(ZS *zs, char *buf, int sbuf) {
+	ZSStore *st = &zs->digest.manifest;
+	int bytes;
+
+	if(zs->stage_pos == 0 && zs_store_flush(st) != 0) {
+		zs->stage = ERROR;
+
+		return 0;
+	}
+
+	bytes = zs_store_read(st, zs->stage_pos, buf, sbuf);
+	if(bytes < 0) {
+		zs->stage = ERROR;
+
+		return 0;
+	}
+
+	zs->crc32 = crc_partial(zs->crc32, buf, bytes);
+	zs->stage_pos += bytes;
+
+	if(zs->stage_pos == st->size) {
+		zs->fsize = zs->stage_pos;
+		zs->fsize_compressed = zs->stage_pos;
+
+		zs->completed = 1;
+	}
+
+	return bytes;
+}
+#endif
+
+// Map the current file. The CRC32 is computed on the plan's pool while the
+// data is copied out, or inline for small files and without a pool. Also if
+// a reader already cached it, zs_publish() checks the file against it.
+int zs_map_open(ZS *zs) {
+	struct stat sb;
+	void *data;
+	int fd;
+
+	fd = open(zs->zsf->fpath, O_RDONLY);
+	if(fd == -1)
+		return -1;
+
+	if(fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+
+		return -1;
+	}
+
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(data == MAP_FAILED) {
+		close(fd);
+
+		return -1;
+	}
+
+	madvise(data, sb.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(data, sb.st_size, MADV_HUGEPAGE);
+#endif
+
+	zs->map.data = (char *)data;
+	zs->map.size = sb.st_size;
+	zs->map.fd = fd;
+	zs->map.inline_crc = 0;
+	zs->map.crc = NULL;
+
+	if(zs->zsp->pool != NULL && zs->map.size >= 2 * ZS_CRC_CHUNK)
+		zs->map.crc = zs_crc_parallel(zs->zsp->pool, fd, zs->map.data, zs->map.size);
+
+	if(zs->map.crc == NULL)
+		zs->map.inline_crc = 1;
+
+	return 0;
+}
+
+void zs_map_close(ZS *zs) {
+	unsigned long crc;
+
+	if(zs->map.data == NULL)
+		return;
+
+	if(zs->map.crc != NULL)
+		zs_crc_wait(zs->map.crc, &crc);
+
+	munmap(zs->map.data, zs->map.size);
+	close(zs->map.fd);
+
+	memset(&zs->map, 0, sizeof(zs->map));
+
+	return;
+}
+
+// Before reading a mapping: a file that no longer has the mapped size would
+// fault (SIGBUS) past its end. Returns -1 then.
+int zs_map_check(int fd, size_t size) {
+	struct stat sb;
+
+	if(fstat(fd, &sb) == -1 || (size_t)sb.st_size != size)
+		return -1;
+
+	return 0;
+}
+
+#ifdef WITH_DEFLATE
+int zs_write_filedata_deflate(ZS *zs, char *buf, int sbuf) {
+	z_stream *strm = &zs->codec->deflate;
+	struct timespec start, end;
+	int bytesread;
+
+	if(zs->deflate.init == 0) {
+		zs->deflate.init = 1;
+		zs->deflate.avail_in = 0;
+		zs->deflate.flush = Z_NO_FLUSH;
+	}
+
+	if(zs->adapt.enabled == 1)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+	bytesread = 0;
+
+	strm->avail_out = sbuf;
+	strm->next_out = buf;
+
+	do {
+		deflate(strm, zs->deflate.flush);
+
+		bytesread = sbuf - strm->avail_out;
+
+		if(bytesread == 0) {
+			zs->stage_pos += zs->deflate.avail_in;
+
+			if(zs->deflate.flush == Z_FINISH) {
+				zs->fsize = zs->stage_pos;
+				zs->completed = 1;
+
+				zs->deflate.init = 0;
+
+				break;
+			}
+
+			if(zs->adapt.enabled == 1)
+				zs_adapt(zs);
+
+			zs->deflate.avail_in = fread(zs->deflate.in, 1, sizeof(zs->deflate.in), zs->fp);
+			zs->adapt.in += zs->deflate.avail_in;
+
+			zs->crc32 = crc_partial(zs->crc32, zs->deflate.in, zs->deflate.avail_in);
+			zs_digest_data(zs, zs->deflate.in, zs->deflate.avail_in);
+
+			strm->avail_in = zs->deflate.avail_in;
+			strm->next_in = zs->deflate.in;
+
+			zs->deflate.flush = feof(zs->fp) ? Z_FINISH : Z_NO_FLUSH;
+		}
+	} while(bytesread == 0);
+
+	if(zs->adapt.enabled == 1) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		zs->adapt.busy += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+
+	zs->fsize_compressed += bytesread;
+
+	return bytesread;
+}
+
+// Called between blocks. Once per window, compare the time spent in the codec
+// with the wall time and the target rate and move the level by one step.
+void zs_adapt(ZS *zs) {
+	struct timespec now;
+	double wall, rate, share;
+	int level;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	wall = (now.tv_sec - zs->adapt.start.tv_sec) + (now.tv_nsec - zs->adapt.start.tv_nsec) / 1e9;
+	if(wall < ZS_ADAPT_WINDOW || zs->adapt.busy <= 0)
+		return;
+
+	rate = zs->adapt.in / zs->adapt.busy;
+	share = 100 * zs->adapt.busy / wall;
+
+	level = zs->adapt.level;
+
+	// Behind: too slow for the target or the consumer waits for us. Raise
+	// it again only with some headroom, to not oscillate.
+	if((zs->adapt.rate != 0 && rate < zs->adapt.rate) || (zs->adapt.cpu != 0 && share > zs->adapt.cpu))
+		level--;
+	else if((zs->adapt.rate == 0 || rate > 1.25 * zs->adapt.rate) && (zs->adapt.cpu == 0 || share < 0.75 * zs->adapt.cpu))
+		level++;
+
+	if(level < Z_BEST_SPEED)
+		level = Z_BEST_SPEED;
+	else if(level > Z_BEST_COMPRESSION)
+		level = Z_BEST_COMPRESSION;
+
+	// All input is consumed, deflateParams() only has to flush the last block
+	if(level != zs->adapt.level && deflateParams(&zs->codec->deflate, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+		zs->adapt.level = level;
+		zs->codec->level = level;
+	}
+
+	zs->adapt.start = now;
+	zs->adapt.busy = 0;
+	zs->adapt.in = 0;
+
+	return;
+}
+#endif
+
+#ifdef WITH_BZIP2
+int zs_write_filedata_bzip2(ZS *zs, char *buf, int sbuf) {
+	bz_stream *strm = &zs->codec->bzip2;
+	int bytesread;
+
+	if(zs->bzip2.init == 0) {
+		zs->bzip2.init = 1;
+		zs->bzip2.avail_in = 0;
+		zs->bzip2.flush = BZ_RUN;
+	}
+
+	bytesread = 0;
+
+	strm->avail_out = sbuf;
+	strm->next_out = buf;
+
+	do {
+		BZ2_bzCompress(strm, zs->bzip2.flush);
+
+		bytesread = sbuf - strm->avail_out;
+
+		if(bytesread == 0) {
+			zs->stage_pos += zs->bzip2.avail_in;
+
+			if(zs->bzip2.flush == BZ_FINISH) {
+				zs->fsize = zs->stage_pos;
+				zs->completed = 1;
+
+				zs->bzip2.init = 0;
+
+				break;
+			}
+
+			zs->bzip2.avail_in = fread(zs->bzip2.in, 1, sizeof(zs->bzip2.in), zs->fp);
+
+			zs->crc32 = crc_partial(zs->crc32, zs->bzip2.in, zs->bzip2.avail_in);
+			zs_digest_data(zs, zs->bzip2.in, zs->bzip2.avail_in);
+
+			strm->avail_in = zs->bzip2.avail_in;
+			strm->next_in = zs->bzip2.in;
+
+			zs->bzip2.flush = feof(zs->fp) ? BZ_FINISH : BZ_RUN;
+		}
+	} while(bytesread == 0);
+
+	zs->fsize_compressed += bytesread;
+
+	return bytesread;
+}
+
+// Entries above the small file size of a plan with a pool and pbzip2 set
+int zs_pbzip2_entry(ZS *zs) {
+	if(zs->zsp->pbzip2 == 0 || zs->zsp->pool == NULL)
+		return 0;
+
+	return (zs_get_lfdsize(zs->zsf) != 0) ? 1 : 0;
+}
+
+// Input is cut into blocks as libbz2 would, the blocks are compressed on the
+// pool and joined in order, see pbzip2.c
+int zs_write_filedata_pbzip2(ZS *zs, char *buf, int sbuf) {
+	ZSPbzip2 *pb = &zs->bzip2.parallel;
+	int bytesread;
+
+	if(zs->bzip2.init == 0) {
+		if(zs_pbzip2_init(pb, zs->zsp->pool, zs->bzip2.level, zs->zsp->pbzip2) != 0) {
+			zs->stage = ERROR;
+
+			return 0;
+		}
+
+		zs->bzip2.init = 1;
+		zs->bzip2.avail_in = 0;
+		zs->bzip2.pos = 0;
+	}
+
+	for(;;) {
+		bytesread = zs_pbzip2_read(pb, buf, sbuf);
+		if(bytesread != 0)
+			break;
+
+		if(pb->eof == 1) {
+			zs->fsize = zs->stage_pos;
+			zs->completed = 1;
+
+			zs_pbzip2_free(pb);
+			zs->bzip2.init = 0;
+
+			break;
+		}
+
+		if(zs->bzip2.pos == zs->bzip2.avail_in) {
+			if(ferror(zs->fp)) {
+				bytesread = -1;
+				break;
+			}
+
+			if(feof(zs->fp)) {
+				zs_pbzip2_finish(pb);
+				continue;
+			}
+
+			zs->bzip2.avail_in = fread(zs->bzip2.in, 1, sizeof(zs->bzip2.in), zs->fp);
+			zs->bzip2.pos = 0;
+
+			zs->stage_pos += zs->bzip2.avail_in;
+
+			zs->crc32 = crc_partial(zs->crc32, zs->bzip2.in, zs->bzip2.avail_in);
+			zs_digest_data(zs, zs->bzip2.in, zs->bzip2.avail_in);
+		}
+
+		zs->bzip2.pos += zs_pbzip2_feed(pb, &zs->bzip2.in[zs->bzip2.pos], zs->bzip2.avail_in - zs->bzip2.pos);
+	}
+
+	if(bytesread < 0) {
+		zs->stage = ERROR;
+
+		return 0;
+	}
+
+	zs->fsize_compressed += bytesread;
+
+	return bytesread;
+}
+#endif
+
+#ifdef WITH_AES
+// Wraps the writer of the actual method: salt and password verifier, the
+// encrypted output of the method, authentication code
+int zs_write_filedata_aes(ZS *zs, char *buf, int sbuf) {
+	char header[ZS_LENGTH_AES_HEADER];
+	int bytes, n;
+
+	bytes = 0;
+
+	if(zs->aes.phase == ZS_AES_PHASE_HEADER) {
+		memcpy(&header[0], zs->aes.key.salt, ZS_AES_SALT_LENGTH);
+		memcpy(&header[ZS_AES_SALT_LENGTH], zs->aes.key.verifier, ZS_AES_VERIFIER_LENGTH);
+
+		n = zs_range_copy(&buf[bytes], sbuf - bytes, header, ZS_LENGTH_AES_HEADER, zs->aes.pos);
+		zs->aes.pos += n;
+		bytes += n;
+
+		if(zs->aes.pos == ZS_LENGTH_AES_HEADER) {
+			zs->aes.phase = ZS_AES_PHASE_DATA;
+			zs->aes.pos = 0;
+		}
+	}
+
+	if(zs->aes.phase == ZS_AES_PHASE_DATA && bytes != sbuf) {
+		n = zs->aes.write_filedata(zs, &buf[bytes], sbuf - bytes);
+
+		zs_aes_encrypt(&zs->aes.ctx, (unsigned char *)&buf[bytes], n);
+		bytes += n;
+
+		if(zs->completed == 1) {
+			zs->completed = 0;
+
+			zs_aes_finish(&zs->aes.ctx, zs->aes.mac);
+
+			zs->aes.phase = ZS_AES_PHASE_MAC;
+		}
+	}
+
+	if(zs->aes.phase == ZS_AES_PHASE_MAC && bytes != sbuf) {
+		n = zs_range_copy(&buf[bytes], sbuf - bytes, (char *)zs->aes.mac, ZS_AES_MAC_LENGTH, zs->aes.pos);
+		zs->aes.pos += n;
+		bytes += n;
+
+		if(zs->aes.pos == ZS_AES_MAC_LENGTH) {
+			zs->aes.phase = ZS_AES_PHASE_DONE;
+
+			zs->fsize_compressed += ZS_LENGTH_AES_HEADER + ZS_AES_MAC_LENGTH;
+			zs->completed = 1;
+		}
+	}
+
+	return bytes;
+}
+#endif
+
+// Decide whether the current file is replayed from an earlier identical
+// entry or captured for later ones. Returns 1 if it is replayed.
+int zs_dedup_begin(ZS *zs) {
+	ZSDedupSlot *slot;
+
+	zs->dedup.capture = NULL;
+	zs->dedup.replay = NULL;
+
+	if(zs->zsf->dedup == 0 || zs->dedup.init == 0)
+		return 0;
+
+	slot = &zs->dedup.slots[zs->zsf->dedup];
+
+	if(slot->state == ZS_DEDUP_READY) {
+		if(zs_store_flush(&zs->dedup.store) != 0) {
+			zs->stage = ERROR;
+
+			return 0;
+		}
+
+		zs->dedup.replay = slot;
+
+		return 1;
+	}
+
+	// Again after the codec budget was exhausted
+	if(slot->state == ZS_DEDUP_EMPTY || slot->state == ZS_DEDUP_CAPTURE) {
+		slot->state = ZS_DEDUP_CAPTURE;
+		slot->pos = zs->dedup.store.size;
+
+		zs->dedup.capture = slot;
+	}
+
+	return 0;
+}
+
+// Keep the output of the current file, until the budget is used up
+void zs_dedup_capture(ZS *zs, const char *buf, int len) {
+	ZSDedupSlot *slot = zs->dedup.capture;
+	size_t budget = zs->zsp->dedup.budget;
+
+	if(budget != 0 && zs->dedup.store.size + len > budget) {
+		slot->state = ZS_DEDUP_FAILED;
+		zs->dedup.capture = NULL;
+
+		return;
+	}
+
+	if(zs_store_append(&zs->dedup.store, buf, len) != 0) {
+		slot->state = ZS_DEDUP_FAILED;
+		zs->dedup.capture = NULL;
+	}
+
+	return;
+}
+
+// The current file is complete, its values go with the captured output
+void zs_dedup_end(ZS *zs) {
+	ZSDedupSlot *slot = zs->dedup.capture;
+
+	zs->dedup.capture = NULL;
+	zs->dedup.replay = NULL;
+
+	if(slot == NULL)
+		return;
+
+	slot->len = zs->dedup.store.size - slot->pos;
+	slot->crc32 = zs->crc32;
+	slot->fsize = zs->fsize;
+#ifdef WITH_DIGEST
+	slot->digest = zs->digest.digest;
+#endif
+
+	slot->state = (slot->len == zs->fsize_compressed) ? ZS_DEDUP_READY : ZS_DEDUP_FAILED;
+
+	return;
+}
+
+// Start the digests of the current file. Copied entries have none, replayed
+// ones take those of the first entry of their group.
+void zs_digest_begin(ZS *zs) {
+#ifdef WITH_DIGEST
+	zs->digest.active = 0;
+
+	if(zs->digest.init == 0 || zs->dedup.replay != NULL)
+		return;
+
+	if(zs->zsf->compression == ZS_COMPRESS_RAW || zs->zsf->compression == ZS_COMPRESS_MANIFEST)
+		return;
+
+	if(zs_digest_start(&zs->digest.ctx) != 0) {
+		zs->stage = ERROR;
+
+		return;
+	}
+
+	zs->digest.active = 1;
+#else
+	(void)zs;
+#endif
+
+	return;
+}
+
+// Uncompressed data of the current file, wherever the CRC32 sees it
+void zs_digest_data(ZS *zs, const void *data, size_t len) {
+#ifdef WITH_DIGEST
+	if(zs->digest.active == 1)
+		zs_digest_update(&zs->digest.ctx, data, len);
+#else
+	(void)zs;
+	(void)data;
+	(void)len;
+#endif
+
+	return;
+}
+
+// Hand the digests of the completed file to the callback and the manifest
+void zs_digest_end(ZS *zs) {
+#ifdef WITH_DIGEST
+	if(zs->digest.init == 0 || zs->zsf->compression == ZS_COMPRESS_MANIFEST)
+		return;
+
+	if(zs->digest.active == 1) {
+		zs->digest.active = 0;
+
+		if(zs_digest_finish(&zs->digest.ctx, &zs->digest.digest) != 0) {
+			zs->stage = ERROR;
+
+			return;
+		}
+	}
+	else if(zs->dedup.replay != NULL)
+		zs->digest.digest = zs->dedup.replay->digest;
+	else
+		memset(&zs->digest.digest, 0, sizeof(ZSDigest));
+
+	if(zs->digest.fn != NULL)
+		zs->digest.fn(zs->digest.arg, zs->zsf->fname, &zs->digest.digest);
+
+	if(zs->zsp->digest.manifest != NULL && zs_digest_manifest(&zs->digest.manifest, zs->zsf->fname, &zs->digest.digest) != 0)
+		zs->stage = ERROR;
+#else
+	(void)zs;
 #endif
-	}
 
-	if(zs->zsd.nfiles != 0) {
-		pzsf = zs->zsd.files;
+	return;
+}
 
-		while(pzsf->next != NULL)
-			pzsf = pzsf->next;
+// Make room for len bytes
+static int zs_small_grow(char **buf, size_t *size, size_t len) {
+	char *p;
 
-		pzsf->next = zsf;
-		zsf->prev = pzsf;
-	}
-	else
-		zs->zsd.files = zsf;
+	if(len <= *size)
+		return 0;
+
+	p = (char *)realloc(*buf, len);
+	if(p == NULL)
+		return -1;
 
-	zs->zsd.nfiles++;
+	*buf = p;
+	*size = len;
 
 	return 0;
 }
 
-int zs_read(ZS *zs, char *buf, int sbuf) {
-	int bytes;
+// Read the current file with one call and compress it in one go. Returns 1
+// if the memory budget of the codec pool is exhausted.
+int zs_small_load(ZS *zs) {
+	size_t bytes;
+	ssize_t n = 0;
+	int fd, rv;
+
+	if(zs->zsf->compression != ZS_COMPRESS_NONE && zs->codec == NULL) {
+		rv = zs_codec_acquire(zs);
+		if(rv != 0)
+			return rv;
+	}
 
-	if(zs == NULL)
+	// One byte more than planned to notice a file that grew
+	if(zs_small_grow(&zs->small.in, &zs->small.sin, zs->zsf->fsize + 1) != 0)
 		return -1;
 
-	zs->finalized = 1;
+	fd = open(zs->zsf->fpath, O_RDONLY);
+	if(fd == -1)
+		return -1;
 
-	bytes = 0;
+	for(bytes = 0; bytes < zs->zsf->fsize + 1; bytes += n) {
+		n = read(fd, &zs->small.in[bytes], zs->zsf->fsize + 1 - bytes);
+		if(n <= 0)
+			break;
+	}
 
-	do {
-		zs_stager(zs);
+	close(fd);
 
-		if(zs->stage == ERROR)
-			return -1;
+	// The header announces the planned size, a changed file can't be sent
+	if(n < 0 || bytes != zs->zsf->fsize)
+		return -1;
 
-		if(zs->stage == FIN)
-			return bytes;
+	zs->small.crc32 = crc_finish(crc_partial(crc_start(), zs->small.in, bytes));
+	zs->small.fsize = bytes;
 
-		switch(zs->stage) {
-			case LF_HEADER:
-				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_LFH);
-				break;
-			case LF_DESCRIPTOR:
-				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_LFD);
-				break;
-			case CD_HEADER:
-				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_CDH);
-				break;
-			case EOCD:
-				bytes += zs_write_stagedata(zs, &buf[bytes], sbuf - bytes, ZS_LENGTH_EOCD);
-				break;
-			case LF_NAME:
-			case CD_NAME:
-				bytes += zs_write_filename(zs, &buf[bytes], sbuf - bytes);
-				break;
-			case LF_DATA:
-				bytes += zs->write_filedata(zs, &buf[bytes], sbuf - bytes);
-				break;
-			default:
+	zs_digest_begin(zs);
+	zs_digest_data(zs, zs->small.in, bytes);
+
+	switch(zs->zsf->compression) {
+		case ZS_COMPRESS_NONE:
+			zs->small.data = zs->small.in;
+			zs->small.len = bytes;
+			break;
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE: {
+			size_t bound;
+
+			bound = deflateBound(&zs->codec->deflate, bytes);
+			if(zs_small_grow(&zs->small.out, &zs->small.sout, bound) != 0)
 				return -1;
-		}
-	} while(bytes != sbuf);
 
-	return bytes;
-}
+			zs->codec->deflate.next_in = (Bytef *)zs->small.in;
+			zs->codec->deflate.avail_in = bytes;
+			zs->codec->deflate.next_out = (Bytef *)zs->small.out;
+			zs->codec->deflate.avail_out = bound;
 
-int zs_write_stagedata(ZS *zs, char *buf, int sbuf, int size) {
-	int i;
-	int bytes, bytesread;
+			if(deflate(&zs->codec->deflate, Z_FINISH) != Z_STREAM_END)
+				return -1;
 
-	bytes = 0;
+			zs->small.data = zs->small.out;
+			zs->small.len = bound - zs->codec->deflate.avail_out;
+			break;
+		}
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2: {
+			size_t bound;
 
-	bytesread = size - zs->stage_pos;
-	if(sbuf < bytesread)
-		bytesread = sbuf;
+			// See the bzip2 manual, BZ2_bzBuffToBuffCompress()
+			bound = bytes + bytes / 100 + 600;
+			if(zs_small_grow(&zs->small.out, &zs->small.sout, bound) != 0)
+				return -1;
 
-	for(i = 0; i < bytesread; i++) {
-		buf[bytes] = zs->stage_data[i + zs->stage_pos];
+			zs->codec->bzip2.next_in = zs->small.in;
+			zs->codec->bzip2.avail_in = bytes;
+			zs->codec->bzip2.next_out = zs->small.out;
+			zs->codec->bzip2.avail_out = bound;
 
-		bytes++;
+			do {
+				rv = BZ2_bzCompress(&zs->codec->bzip2, BZ_FINISH);
+			} while(rv == BZ_FINISH_OK && zs->codec->bzip2.avail_out != 0);
+
+			if(rv != BZ_STREAM_END)
+				return -1;
+
+			zs->small.data = zs->small.out;
+			zs->small.len = bound - zs->codec->bzip2.avail_out;
+			break;
+		}
+#endif
+		default:
+			return -1;
 	}
 
-	zs->stage_pos += bytesread;
+	// Not needed any longer, the next file may use it
+	zs_codec_release(zs);
 
-	return bytes;
+	return 0;
 }
 
-int zs_write_filename(ZS *zs, char *buf, int sbuf) {
-	int i;
-	int bytes, bytesread;
-
-	bytes = 0;
+// Compress the current file before its local header is built, if it has no
+// data descriptor. Returns 0 if the header can be built.
+int zs_small_begin(ZS *zs) {
+	int rv;
 
-	bytesread = zs->zsf->lfname - zs->stage_pos;
-	if(sbuf < bytesread)
-		bytesread = sbuf;
+	if(zs->small.ready == 1 || zs_get_lfdsize(zs->zsf) != 0)
+		return 0;
 
-	for(i = 0; i < bytesread; i++) {
-		buf[bytes] = zs->zsf->fname[i + zs->stage_pos];
+	rv = zs_small_load(zs);
+	if(rv != 0) {
+		if(rv == -1)
+			zs->stage = ERROR;
 
-		bytes++;
+		return rv;
 	}
 
-	zs->stage_pos += bytesread;
+	zs->small.ready = 1;
 
-	return bytes;
-}
+	zs->crc32 = zs->small.crc32;
+	zs->fsize = zs->small.fsize;
+	zs->fsize_compressed = zs->small.len;
 
-int zs_write_filedata_none(ZS *zs, char *buf, int sbuf) {
-	int bytesread;
+	return 0;
+}
 
-	bytesread = fread(buf, 1, sbuf, zs->fp);
-	zs->stage_pos += bytesread;
+// Get a compressor context for the current file, from the plan's codec pool
+// if it has one. Returns 1 if the memory budget of the pool is exhausted.
+int zs_codec_acquire(ZS *zs) {
+	int level, rv;
 
-	zs->zsf->crc32 = crc_partial(zs->zsf->crc32, buf, bytesread);
+	level = zs->zsf->level;
 
-	zs->zsf->fsize_compressed += bytesread;
+	switch(zs->zsf->compression) {
+#ifdef WITH_DEFLATE
+		case ZS_COMPRESS_DEFLATE:
+			// The adapted level carries over to the next entry
+			if(zs->adapt.enabled == 1) {
+				if(zs->adapt.level == 0)
+					zs->adapt.level = (level == Z_DEFAULT_COMPRESSION) ? 6 : level;
 
-	if(ferror(zs->fp) || feof(zs->fp)) {	// ERROR or EOF
-		zs->zsf->fsize = zs->stage_pos;
-		zs->zsf->fsize_compressed = zs->stage_pos;
+				level = zs->adapt.level;
 
-		zs->zsf->completed = 1;
+				clock_gettime(CLOCK_MONOTONIC, &zs->adapt.start);
+				zs->adapt.busy = 0;
+				zs->adapt.in = 0;
+			}
+			break;
+#endif
+#ifdef WITH_BZIP2
+		case ZS_COMPRESS_BZIP2:
+			// The blocks get contexts of their own on the pool
+			if(zs_pbzip2_entry(zs) == 1)
+				return 0;
+			break;
+#endif
+		default:
+			return 0;
 	}
 
-	return bytesread;
-}
+	if(zs->zsp->codecs == NULL) {
+		if(zs->spare != NULL && zs->spare->method == zs->zsf->compression && zs_codec_reset(zs->spare, level) == 0) {
+			zs->codec = zs->spare;
+			zs->spare = NULL;
+		}
+		else
+			zs->codec = zs_codec_new(zs->zsf->compression, level);
 
-#ifdef WITH_DEFLATE
-int zs_write_filedata_deflate(ZS *zs, char *buf, int sbuf) {
-	int bytesread;
+		rv = (zs->codec != NULL) ? 0 : -1;
+	}
+	else
+		rv = zs_codec_get(zs->zsp->codecs, zs->zsf->compression, level, &zs->codec);
 
-	if(zs->deflate.init == 0) {
-		zs->deflate.init = 1;
-		zs->deflate.avail_in = 0;
-		zs->deflate.flush = Z_NO_FLUSH;
+	if(rv == 1)
+		zs->again = 1;
+	else if(rv == -1)
+		zs->stage = ERROR;
 
-		zs->deflate.strm.zalloc = Z_NULL;
-		zs->deflate.strm.zfree = Z_NULL;
-		zs->deflate.strm.opaque = Z_NULL;
+	return rv;
+}
 
-		deflateInit2(&zs->deflate.strm, zs->deflate.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-	}
+void zs_codec_release(ZS *zs) {
+	if(zs->codec == NULL)
+		return;
 
-	bytesread = 0;
+	if(zs->zsp->codecs != NULL)
+		zs_codec_put(zs->zsp->codecs, zs->codec);
+	else {
+		zs_codec_free(zs->spare);
+		zs->spare = zs->codec;
+	}
 
-	zs->deflate.strm.avail_out = sbuf;
-	zs->deflate.strm.next_out = buf;
+	zs->codec = NULL;
 
-	do {
-		deflate(&zs->deflate.strm, zs->deflate.flush);
+	return;
+}
 
-		bytesread = sbuf - zs->deflate.strm.avail_out;
+// First entry of the plan, for the local headers and the central directory
+ZSFile *zs_entry_first(ZS *zs) {
+	if(zs->zsp->compact.enabled == 0)
+		return zs->zsp->zsd.files;
 
-		if(bytesread == 0) {
-			zs->stage_pos += zs->deflate.avail_in;
+	zs_store_reader_init(&zs->compact.reader, &zs->zsp->compact.store);
 
-			if(zs->deflate.flush == Z_FINISH) {
-				deflateEnd(&zs->deflate.strm);
+	memset(&zs->compact.entry, 0, sizeof(ZSEntry));
 
-				zs->zsf->fsize = zs->stage_pos;
-				zs->zsf->completed = 1;
+	if(zs->stage == CD_HEADER) {
+		if(zs_store_flush(&zs->compact.cd) != 0) {
+			zs->stage = ERROR;
 
-				zs->deflate.init = 0;
+			return NULL;
+		}
 
-				break;
-			}
+		zs_store_reader_init(&zs->compact.cdreader, &zs->compact.cd);
+	}
 
-			zs->deflate.avail_in = fread(zs->deflate.in, 1, sizeof(zs->deflate.in), zs->fp);
+	return zs_entry_load(zs);
+}
 
-			zs->zsf->crc32 = crc_partial(zs->zsf->crc32, zs->deflate.in, zs->deflate.avail_in);
+ZSFile *zs_entry_next(ZS *zs) {
+	ZSFile *zsf = zs->zsf;
 
-			zs->deflate.strm.avail_in = zs->deflate.avail_in;
-			zs->deflate.strm.next_in = zs->deflate.in;
+	if(zs->zsp->compact.enabled == 0)
+		return zsf->next;
 
-			zs->deflate.flush = feof(zs->fp) ? Z_FINISH : Z_NO_FLUSH;
-		}
-	} while(bytesread == 0);
+	zs->compact.entry.offset += ZS_LENGTH_LFH + zsf->lfname + zsf->lextra + zs->compact.entry.fsize_compressed + zs_get_lfdsize(zsf);
 
-	zs->zsf->fsize_compressed += bytesread;
+	if(zs->stage == LF_HEADER) {
+		zs->compact.cdsize += ZS_LENGTH_CDH + zsf->lfname + zsf->lextra;
+		zs->compact.cdoffset = zs->compact.entry.offset;
+	}
 
-	return bytesread;
+	return zs_entry_load(zs);
 }
-#endif
 
-#ifdef WITH_BZIP2
-int zs_write_filedata_bzip2(ZS *zs, char *buf, int sbuf) {
-	int bytesread;
+// Decode the next record of a compact plan, in the central directory along
+// with the values of this cursor
+ZSFile *zs_entry_load(ZS *zs) {
+	ZSEntry *entry = &zs->compact.entry;
+	size_t crc;
 
-	if(zs->bzip2.init == 0) {
-		zs->bzip2.init = 1;
-		zs->bzip2.avail_in = 0;
-		zs->bzip2.flush = Z_NO_FLUSH;
+	if(zs_store_reader_eof(&zs->compact.reader))
+		return NULL;
 
-		zs->bzip2.strm.bzalloc = Z_NULL;
-		zs->bzip2.strm.bzfree = Z_NULL;
-		zs->bzip2.strm.opaque = Z_NULL;
+	if(zs_store_decode(&zs->compact.reader, &zs->compact.names, zs->zsp->compact.basedir, &zs->compact.file) != 0) {
+		zs->stage = ERROR;
 
-		BZ2_bzCompressInit(&zs->bzip2.strm, zs->bzip2.level, 0, 30);
+		return NULL;
 	}
 
-	bytesread = 0;
+	if(zs->stage == CD_HEADER) {
+		if(zs_store_reader_varint(&zs->compact.cdreader, &crc) != 0 || zs_store_reader_varint(&zs->compact.cdreader, &entry->fsize) != 0 || zs_store_reader_varint(&zs->compact.cdreader, &entry->fsize_compressed) != 0)
+			zs->stage = ERROR;
 
-	zs->bzip2.strm.avail_out = sbuf;
-	zs->bzip2.strm.next_out = buf;
+		entry->crc32 = crc;
+	}
 
-	do {
-		BZ2_bzCompress(&zs->bzip2.strm, zs->bzip2.flush);
+	return &zs->compact.file;
+}
 
-		bytesread = sbuf - zs->bzip2.strm.avail_out;
+// Store the values of the just completed file in the plan, such that
+// the central directory can be built from them. Every reader produces
+// the same values, unless the file changed since the first reader.
+int zs_publish(ZS *zs) {
+	ZSFile *zsf = zs->zsf;
+	ZSEntry *entry;
+	size_t offset = 0;
+	int rv = 0;
 
-		if(bytesread == 0) {
-			zs->stage_pos += zs->bzip2.avail_in;
+	// Compact plans: offsets follow from the sizes, see zs_entry_next()
+	if(zs->zsp->compact.enabled == 1) {
+		rv |= zs_store_varint(&zs->compact.cd, zs->crc32);
+		rv |= zs_store_varint(&zs->compact.cd, zs->fsize);
+		rv |= zs_store_varint(&zs->compact.cd, zs->fsize_compressed);
 
-			if(zs->bzip2.flush == BZ_FINISH) {
-				BZ2_bzCompressEnd(&zs->bzip2.strm);
+		zs->compact.entry.fsize_compressed = zs->fsize_compressed;
 
-				zs->zsf->fsize = zs->stage_pos;
-				zs->zsf->completed = 1;
+		return (rv != 0) ? -1 : 0;
+	}
 
-				zs->bzip2.init = 0;
+	// Output of its own, the plan is left alone
+	if(zs->entries != NULL) {
+		entry = &zs->entries[zs->entry];
 
-				break;
-			}
+		if(zsf->prev != NULL) {
+			offset = entry[-1].offset;
 
-			zs->bzip2.avail_in = fread(zs->bzip2.in, 1, sizeof(zs->bzip2.in), zs->fp);
+			offset += ZS_LENGTH_LFH;
+			offset += zsf->prev->lfname + zsf->prev->lextra;
+			offset += entry[-1].fsize_compressed;
+			offset += zs_get_lfdsize(zsf->prev);
+		}
 
-			zs->zsf->crc32 = crc_partial(zs->zsf->crc32, zs->bzip2.in, zs->bzip2.avail_in);
+		entry->crc32 = zs->crc32;
+		entry->fsize = zs->fsize;
+		entry->fsize_compressed = zs->fsize_compressed;
+		entry->offset = offset;
 
-			zs->bzip2.strm.avail_in = zs->bzip2.avail_in;
-			zs->bzip2.strm.next_in = zs->bzip2.in;
+		return 0;
+	}
 
-			zs->bzip2.flush = feof(zs->fp) ? BZ_FINISH : BZ_RUN;
+	pthread_mutex_lock(&zs->zsp->lock);
+
+	if(zsf->cached == 0) {
+		zsf->crc32 = zs->crc32;
+		zsf->fsize = zs->fsize;
+		zsf->fsize_compressed = zs->fsize_compressed;
+
+		zsf->cached = 1;
+	}
+	else if(zsf->crc32 != zs->crc32 || zsf->fsize != zs->fsize || zsf->fsize_compressed != zs->fsize_compressed)
+		rv = -1;
+
+	if(zsf->placed == 0) {
+		if(zsf->prev != NULL) {
+			offset = zsf->prev->offset;
+
+			offset += ZS_LENGTH_LFH;
+			offset += zsf->prev->lfname + zsf->prev->lextra;
+			offset += zsf->prev->fsize_compressed;
+			offset += zs_get_lfdsize(zsf->prev);
 		}
-	} while(bytesread == 0);
 
-	zs->zsf->fsize_compressed += bytesread;
+		zsf->offset = offset;
+		zsf->placed = 1;
+	}
+
+	pthread_mutex_unlock(&zs->zsp->lock);
 
-	return bytesread;
+	return rv;
 }
-#endif
 
 void zs_stager(ZS *zs) {
 	if(zs->stage == NONE) {
-		zs->zsf = zs->zsd.files;
-
 		zs->stage = LF_HEADER;
 		zs->stage_pos = 0;
+
+		zs->zsf = zs_entry_first(zs);
+		zs->entry = 0;
 	}
 
 stager_top:
 	if(zs->stage == LF_HEADER) {
 		if(zs->zsf == NULL) {
-			zs->zsf = zs->zsd.files;
-
 			zs->stage = CD_HEADER;
 			zs->stage_pos = 0;
+
+			// Offsets only grow, all of them fit if the CD offset does
+			if(zs_get_cdoffset(zs) > ZS_MAX_SIZE || zs_get_cdsize(zs) > ZS_MAX_SIZE)
+				zs->stage = ERROR;
+			else
+				zs->zsf = zs_entry_first(zs);
+
+			zs->entry = 0;
 		}
 		else {
 			if(zs->stage_pos == 0) {
-				zs_build_lfh(zs);
+				if(zs_small_begin(zs) == 0)
+					zs_build_lfh(zs);
 			}
 			else if(zs->stage_pos == ZS_LENGTH_LFH) {
 				zs->stage = LF_NAME;
@@ -411,66 +2641,136 @@ stager_top:
 	}
 
 	if(zs->stage == LF_NAME) {
-		if(zs->stage_pos == zs->zsf->lfname) {
+		if(zs->stage_pos == zs->zsf->lfname + zs->zsf->lextra && (zs->small.ready == 1 || zs_dedup_begin(zs) == 1 || zs_codec_acquire(zs) == 0)) {
 			zs->stage = LF_DATA;
 			zs->stage_pos = 0;
 
-			zs->zsf->crc32 = crc_start();
-
-			zs->fp = fopen(zs->zsf->fpath, "rb");
-			if(zs->fp == NULL)
-				zs->stage = ERROR;
-
-			switch(zs->zsf->compression) {
-				case ZS_COMPRESS_NONE:
-					zs->write_filedata = zs_write_filedata_none;
-					break;
+			zs->crc32 = crc_start();
+			zs->crc_final = 0;
+			zs->fsize = 0;
+			zs->fsize_compressed = 0;
+			zs->completed = 0;
+
+			if(zs->small.ready == 0)
+				zs_digest_begin(zs);
+
+			// Skip the source file and the codec
+			if(zs->small.ready == 1)
+				zs->write_filedata = zs_write_filedata_small;
+			else if(zs->dedup.replay != NULL)
+				zs->write_filedata = zs_write_filedata_replay;
+#ifdef WITH_DIGEST
+			else if(zs->zsf->compression == ZS_COMPRESS_MANIFEST)
+				zs->write_filedata = zs_write_filedata_manifest;
+#endif
+			else {
+				if(zs->zsf->compression == ZS_COMPRESS_NONE && zs->zsp->mmap == 1)
+					zs_map_open(zs);
+
+				if(zs->map.data == NULL) {
+					zs->fp = fopen(zs->zsf->fpath, "rb");
+					if(zs->fp == NULL)
+						zs->stage = ERROR;
+					else if(zs->zsf->compression == ZS_COMPRESS_RAW && fseeko(zs->fp, zs->zsf->raw_offset, SEEK_SET) != 0)
+						zs->stage = ERROR;
+				}
+
+				switch(zs->zsf->compression) {
+					case ZS_COMPRESS_NONE:
+						if(zs->map.data != NULL)
+							zs->write_filedata = zs_write_filedata_mmap;
+						else
+							zs->write_filedata = zs_write_filedata_none;
+						break;
+					case ZS_COMPRESS_RAW:
+						zs->write_filedata = zs_write_filedata_raw;
+						break;
 #ifdef WITH_DEFLATE
-				case ZS_COMPRESS_DEFLATE:
-					zs->deflate.level = zs->zsf->level;
-					zs->write_filedata = zs_write_filedata_deflate;
-					break;
+					case ZS_COMPRESS_DEFLATE:
+						zs->deflate.level = zs->zsf->level;
+						zs->write_filedata = zs_write_filedata_deflate;
+						break;
 #endif
 #ifdef WITH_BZIP2
-				case ZS_COMPRESS_BZIP2:
-					zs->bzip2.level = zs->zsf->level;
-					zs->write_filedata = zs_write_filedata_bzip2;
-					break;
+					case ZS_COMPRESS_BZIP2:
+						zs->bzip2.level = zs->zsf->level;
+						if(zs_pbzip2_entry(zs) == 1)
+							zs->write_filedata = zs_write_filedata_pbzip2;
+						else
+							zs->write_filedata = zs_write_filedata_bzip2;
+						break;
 #endif
+					default:
+						zs->stage = ERROR;
+						break;
+				}
 			}
+
+#ifdef WITH_AES
+			if(zs->zsf->aes != NULL) {
+				zs->aes.write_filedata = zs->write_filedata;
+				zs->aes.phase = ZS_AES_PHASE_HEADER;
+				zs->aes.pos = 0;
+
+				if(zs_aes_key_derive(&zs->aes.key, zs->zsf->aes) != 0 || zs_aes_init(&zs->aes.ctx, &zs->aes.key) != 0)
+					zs->stage = ERROR;
+				else
+					zs->aes.init = 1;
+
+				zs->write_filedata = zs_write_filedata_aes;
+			}
+#endif
 		}
 	}
 
 	if(zs->stage == LF_DATA) {
-		if(zs->zsf->completed == 1) {
+		if(zs->completed == 1) {
 			zs->stage = LF_DESCRIPTOR;
 			zs->stage_pos = 0;
 
-			fclose(zs->fp);
+			if(zs->fp != NULL) {
+				fclose(zs->fp);
+				zs->fp = NULL;
+			}
 
-			zs->zsf->crc32 = crc_finish(zs->zsf->crc32);
+			zs_map_close(zs);
 
-			if(zs->zsf->prev != NULL) {
-				zs->zsf->offset = zs->zsf->prev->offset;
+			zs_codec_release(zs);
 
-				zs->zsf->offset += ZS_LENGTH_LFH;
-				zs->zsf->offset += zs->zsf->prev->lfname;
-				zs->zsf->offset += zs->zsf->prev->fsize_compressed;
-				zs->zsf->offset += ZS_LENGTH_LFD;
+#ifdef WITH_AES
+			if(zs->aes.init == 1) {
+				zs_aes_free(&zs->aes.ctx);
+				zs->aes.init = 0;
 			}
+
+			zs_aes_key_clear(&zs->aes.key);
+#endif
+
+			if(zs->crc_final == 0)
+				zs->crc32 = crc_finish(zs->crc32);
+
+			zs_digest_end(zs);
+			zs_dedup_end(zs);
+
+			if(zs->fsize > ZS_MAX_SIZE || zs->fsize_compressed > ZS_MAX_SIZE)
+				zs->stage = ERROR;
+			else if(zs_publish(zs) != 0)
+				zs->stage = ERROR;
 		}
 	}
 
 	if(zs->stage == LF_DESCRIPTOR) {
-		if(zs->stage_pos == 0) {
+		// None if the sizes are in the local header
+		if(zs->stage_pos == 0 && zs_get_lfdsize(zs->zsf) != 0) {
 			zs_build_lfd(zs);
 		}
-		else if(zs->stage_pos == ZS_LENGTH_LFD) {
-			zs->zsf = zs->zsf->next;
-
+		else if(zs->stage_pos == zs_get_lfdsize(zs->zsf)) {
 			zs->stage = LF_HEADER;
 			zs->stage_pos = 0;
 
+			zs->zsf = zs_entry_next(zs);
+			zs->entry++;
+
 			goto stager_top;
 		}
 	}
@@ -492,12 +2792,13 @@ stager_top:
 	}
 
 	if(zs->stage == CD_NAME) {
-		if(zs->stage_pos == zs->zsf->lfname) {
-			zs->zsf = zs->zsf->next;
-
+		if(zs->stage_pos == zs->zsf->lfname + zs->zsf->lextra) {
 			zs->stage = CD_HEADER;
 			zs->stage_pos = 0;
 
+			zs->zsf = zs_entry_next(zs);
+			zs->entry++;
+
 			goto stager_top;
 		}
 	}
@@ -518,81 +2819,127 @@ stager_top:
 	return;
 }
 
-void zs_build_lfh(ZS *zs) {
-	struct tm *ltime;
-	int tmp;
+// MS-DOS date (high word) and time (low word) in local time
+unsigned long zs_dostime(time_t t) {
+	struct tm ltime;
+
+	localtime_r(&t, &ltime);
+
+	return zs_dostime_tm(&ltime);
+}
+
+unsigned long zs_dostime_tm(const struct tm *tm) {
+	unsigned long dostime;
+
+	dostime = 0;
+	dostime |= (tm->tm_hour << 11);
+	dostime |= (tm->tm_min << 5);
+	dostime |= (tm->tm_sec / 2);
 
+	dostime |= (unsigned long)((tm->tm_year - 80) << 9) << 16;
+	dostime |= (unsigned long)((tm->tm_mon + 1) << 5) << 16;
+	dostime |= (unsigned long)tm->tm_mday << 16;
+
+	return dostime;
+}
+
+void zs_build_lfh(ZS *zs) {
 	if(zs == NULL)
 		return;
 
+	memcpy(zs->stage_data, zs->zsf->lfh, ZS_LENGTH_LFH);
+
+	if(zs->zsf->flags & ZS_FLAG_DESCRIPTOR)
+		return;
+
+	// CRC32
+	zs->stage_data[14] = ((zs->crc32 >>  0) & 0xFF);
+	zs->stage_data[15] = ((zs->crc32 >>  8) & 0xFF);
+	zs->stage_data[16] = ((zs->crc32 >> 16) & 0xFF);
+	zs->stage_data[17] = ((zs->crc32 >> 24) & 0xFF);
+
+	// Compressed Size
+	zs->stage_data[18] = ((zs->fsize_compressed >>  0) & 0xFF);
+	zs->stage_data[19] = ((zs->fsize_compressed >>  8) & 0xFF);
+	zs->stage_data[20] = ((zs->fsize_compressed >> 16) & 0xFF);
+	zs->stage_data[21] = ((zs->fsize_compressed >> 24) & 0xFF);
+
+	// Uncompressed Size
+	zs->stage_data[22] = ((zs->fsize >>  0) & 0xFF);
+	zs->stage_data[23] = ((zs->fsize >>  8) & 0xFF);
+	zs->stage_data[24] = ((zs->fsize >> 16) & 0xFF);
+	zs->stage_data[25] = ((zs->fsize >> 24) & 0xFF);
+
+	return;
+}
+
+void zs_prepare_lfh(ZSFile *zsf) {
+	char *data = zsf->lfh;
+
 	// Signature
-	zs->stage_data[ 0] = 0x50;
-	zs->stage_data[ 1] = 0x4b;
-	zs->stage_data[ 2] = 0x03;
-	zs->stage_data[ 3] = 0x04;
+	data[ 0] = 0x50;
+	data[ 1] = 0x4b;
+	data[ 2] = 0x03;
+	data[ 3] = 0x04;
 
 	// Version
-	zs->stage_data[ 4] = ((zs->zsf->version >>  0) & 0xFF);
-	zs->stage_data[ 5] = ((zs->zsf->version >>  8) & 0xFF);
+	data[ 4] = ((zsf->version >>  0) & 0xFF);
+	data[ 5] = ((zsf->version >>  8) & 0xFF);
 
 	// General Purpose
-	zs->stage_data[ 6] = 0x08;	// Bit3 : CRC32, file sizes unknown at this time
-	zs->stage_data[ 7] = 0x00;
+	data[ 6] = ((zsf->flags >>  0) & 0xFF);
+	data[ 7] = ((zsf->flags >>  8) & 0xFF);
 
 	// Compression Method
-	zs->stage_data[ 8] = ((zs->zsf->compression >>  0) & 0xFF);
-	zs->stage_data[ 9] = ((zs->zsf->compression >>  8) & 0xFF);
+	data[ 8] = ((zsf->method >>  0) & 0xFF);
+	data[ 9] = ((zsf->method >>  8) & 0xFF);
 
 	// Modification Time
-	ltime = localtime(&zs->zsf->ftime);
-	tmp = 0;
-	tmp |= (ltime->tm_hour << 11);
-	tmp |= (ltime->tm_min << 5);
-	tmp |= (ltime->tm_sec / 2);
-	zs->stage_data[10] = ((tmp >>  0) & 0xFF);
-	zs->stage_data[11] = ((tmp >>  8) & 0xFF);
+	data[10] = ((zsf->dostime >>  0) & 0xFF);
+	data[11] = ((zsf->dostime >>  8) & 0xFF);
 
 	// Modification Date
-	tmp = 0;
-	tmp |= ((ltime->tm_year - 80) << 9);
-	tmp |= ((ltime->tm_mon + 1) << 5);
-	tmp |= ltime->tm_mday;
-	zs->stage_data[12] = ((tmp >>  0) & 0xFF);
-	zs->stage_data[13] = ((tmp >>  8) & 0xFF);
+	data[12] = ((zsf->dostime >> 16) & 0xFF);
+	data[13] = ((zsf->dostime >> 24) & 0xFF);
 
 	// CRC32
-	zs->stage_data[14] = 0x00;
-	zs->stage_data[15] = 0x00;
-	zs->stage_data[16] = 0x00;
-	zs->stage_data[17] = 0x00;
+	data[14] = 0x00;
+	data[15] = 0x00;
+	data[16] = 0x00;
+	data[17] = 0x00;
 
 	// Compressed Size
-	zs->stage_data[18] = 0x00;
-	zs->stage_data[19] = 0x00;
-	zs->stage_data[20] = 0x00;
-	zs->stage_data[21] = 0x00;
+	data[18] = 0x00;
+	data[19] = 0x00;
+	data[20] = 0x00;
+	data[21] = 0x00;
 
 	// Uncompressed Size
-	zs->stage_data[22] = 0x00;
-	zs->stage_data[23] = 0x00;
-	zs->stage_data[24] = 0x00;
-	zs->stage_data[25] = 0x00;
+	data[22] = 0x00;
+	data[23] = 0x00;
+	data[24] = 0x00;
+	data[25] = 0x00;
 
 	// Filename Length
-	zs->stage_data[26] = ((zs->zsf->lfname >>  0) & 0xFF);
-	zs->stage_data[27] = ((zs->zsf->lfname >>  8) & 0xFF);
+	data[26] = ((zsf->lfname >>  0) & 0xFF);
+	data[27] = ((zsf->lfname >>  8) & 0xFF);
 
 	// Extra Field Length
-	zs->stage_data[28] = 0x00;
-	zs->stage_data[29] = 0x00;
+	data[28] = ((zsf->lextra >>  0) & 0xFF);
+	data[29] = ((zsf->lextra >>  8) & 0xFF);
 
 	return;
 }
 
 void zs_build_lfd(ZS *zs) {
+	unsigned long crc;
+
 	if(zs == NULL)
 		return;
 
+	// AE-2 entries carry no CRC32
+	crc = (zs->zsf->flags & ZS_FLAG_ENCRYPTED) ? 0 : zs->crc32;
+
 	// Signature
 	zs->stage_data[ 0] = 0x50;
 	zs->stage_data[ 1] = 0x4b;
@@ -600,33 +2947,47 @@ void zs_build_lfd(ZS *zs) {
 	zs->stage_data[ 3] = 0x08;
 
 	// CRC32
-	zs->stage_data[ 4] = ((zs->zsf->crc32 >>  0) & 0xFF);
-	zs->stage_data[ 5] = ((zs->zsf->crc32 >>  8) & 0xFF);
-	zs->stage_data[ 6] = ((zs->zsf->crc32 >> 16) & 0xFF);
-	zs->stage_data[ 7] = ((zs->zsf->crc32 >> 24) & 0xFF);
+	zs->stage_data[ 4] = ((crc >>  0) & 0xFF);
+	zs->stage_data[ 5] = ((crc >>  8) & 0xFF);
+	zs->stage_data[ 6] = ((crc >> 16) & 0xFF);
+	zs->stage_data[ 7] = ((crc >> 24) & 0xFF);
 
 	// Compressed Size
-	zs->stage_data[ 8] = ((zs->zsf->fsize_compressed >>  0) & 0xFF);
-	zs->stage_data[ 9] = ((zs->zsf->fsize_compressed >>  8) & 0xFF);
-	zs->stage_data[10] = ((zs->zsf->fsize_compressed >> 16) & 0xFF);
-	zs->stage_data[11] = ((zs->zsf->fsize_compressed >> 24) & 0xFF);
+	zs->stage_data[ 8] = ((zs->fsize_compressed >>  0) & 0xFF);
+	zs->stage_data[ 9] = ((zs->fsize_compressed >>  8) & 0xFF);
+	zs->stage_data[10] = ((zs->fsize_compressed >> 16) & 0xFF);
+	zs->stage_data[11] = ((zs->fsize_compressed >> 24) & 0xFF);
 
 	// Uncompressed Size
-	zs->stage_data[12] = ((zs->zsf->fsize >>  0) & 0xFF);
-	zs->stage_data[13] = ((zs->zsf->fsize >>  8) & 0xFF);
-	zs->stage_data[14] = ((zs->zsf->fsize >> 16) & 0xFF);
-	zs->stage_data[15] = ((zs->zsf->fsize >> 24) & 0xFF);
+	zs->stage_data[12] = ((zs->fsize >>  0) & 0xFF);
+	zs->stage_data[13] = ((zs->fsize >>  8) & 0xFF);
+	zs->stage_data[14] = ((zs->fsize >> 16) & 0xFF);
+	zs->stage_data[15] = ((zs->fsize >> 24) & 0xFF);
 
 	return;
 }
 
 void zs_build_cdh(ZS *zs) {
-	struct tm *ltime;
-	int tmp;
+	ZSEntry entry;
+	unsigned long crc;
 
 	if(zs == NULL)
 		return;
 
+	if(zs->zsp->compact.enabled == 1)
+		entry = zs->compact.entry;
+	else if(zs->entries != NULL)
+		entry = zs->entries[zs->entry];
+	else {
+		entry.crc32 = zs->zsf->crc32;
+		entry.fsize = zs->zsf->fsize;
+		entry.fsize_compressed = zs->zsf->fsize_compressed;
+		entry.offset = zs->zsf->offset;
+	}
+
+	// AE-2 entries carry no CRC32
+	crc = (zs->zsf->flags & ZS_FLAG_ENCRYPTED) ? 0 : entry.crc32;
+
 	// Signature
 	zs->stage_data[ 0] = 0x50;
 	zs->stage_data[ 1] = 0x4b;
@@ -642,55 +3003,46 @@ void zs_build_cdh(ZS *zs) {
 	zs->stage_data[ 7] = ((zs->zsf->version >>  8) & 0xFF);
 
 	// General Purpose
-	zs->stage_data[ 8] = 0x08;	// Bit3 : CRC32, file sizes unknown at this time (ignored here)
-	zs->stage_data[ 9] = 0x00;
+	zs->stage_data[ 8] = ((zs->zsf->flags >>  0) & 0xFF);
+	zs->stage_data[ 9] = ((zs->zsf->flags >>  8) & 0xFF);
 
 	// Compression Method
-	zs->stage_data[10] = ((zs->zsf->compression >>  0) & 0xFF);
-	zs->stage_data[11] = ((zs->zsf->compression >>  8) & 0xFF);
+	zs->stage_data[10] = ((zs->zsf->method >>  0) & 0xFF);
+	zs->stage_data[11] = ((zs->zsf->method >>  8) & 0xFF);
 
 	// Modification Time
-	ltime = localtime(&zs->zsf->ftime);
-	tmp = 0;
-	tmp |= (ltime->tm_hour << 11);
-	tmp |= (ltime->tm_min << 5);
-	tmp |= (ltime->tm_sec / 2);
-	zs->stage_data[12] = ((tmp >>  0) & 0xFF);
-	zs->stage_data[13] = ((tmp >>  8) & 0xFF);
+	zs->stage_data[12] = ((zs->zsf->dostime >>  0) & 0xFF);
+	zs->stage_data[13] = ((zs->zsf->dostime >>  8) & 0xFF);
 
 	// Modification Date
-	tmp = 0;
-	tmp |= ((ltime->tm_year - 80) << 9);
-	tmp |= ((ltime->tm_mon + 1) << 5);
-	tmp |= ltime->tm_mday;
-	zs->stage_data[14] = ((tmp >>  0) & 0xFF);
-	zs->stage_data[15] = ((tmp >>  8) & 0xFF);
+	zs->stage_data[14] = ((zs->zsf->dostime >> 16) & 0xFF);
+	zs->stage_data[15] = ((zs->zsf->dostime >> 24) & 0xFF);
 
 	// CRC32
-	zs->stage_data[16] = ((zs->zsf->crc32 >>  0) & 0xFF);
-	zs->stage_data[17] = ((zs->zsf->crc32 >>  8) & 0xFF);
-	zs->stage_data[18] = ((zs->zsf->crc32 >> 16) & 0xFF);
-	zs->stage_data[19] = ((zs->zsf->crc32 >> 24) & 0xFF);
+	zs->stage_data[16] = ((crc >>  0) & 0xFF);
+	zs->stage_data[17] = ((crc >>  8) & 0xFF);
+	zs->stage_data[18] = ((crc >> 16) & 0xFF);
+	zs->stage_data[19] = ((crc >> 24) & 0xFF);
 
 	// Compressed Size
-	zs->stage_data[20] = ((zs->zsf->fsize_compressed >>  0) & 0xFF);
-	zs->stage_data[21] = ((zs->zsf->fsize_compressed >>  8) & 0xFF);
-	zs->stage_data[22] = ((zs->zsf->fsize_compressed >> 16) & 0xFF);
-	zs->stage_data[23] = ((zs->zsf->fsize_compressed >> 24) & 0xFF);
+	zs->stage_data[20] = ((entry.fsize_compressed >>  0) & 0xFF);
+	zs->stage_data[21] = ((entry.fsize_compressed >>  8) & 0xFF);
+	zs->stage_data[22] = ((entry.fsize_compressed >> 16) & 0xFF);
+	zs->stage_data[23] = ((entry.fsize_compressed >> 24) & 0xFF);
 
 	// Uncompressed Size
-	zs->stage_data[24] = ((zs->zsf->fsize >>  0) & 0xFF);
-	zs->stage_data[25] = ((zs->zsf->fsize >>  8) & 0xFF);
-	zs->stage_data[26] = ((zs->zsf->fsize >> 16) & 0xFF);
-	zs->stage_data[27] = ((zs->zsf->fsize >> 24) & 0xFF);
+	zs->stage_data[24] = ((entry.fsize >>  0) & 0xFF);
+	zs->stage_data[25] = ((entry.fsize >>  8) & 0xFF);
+	zs->stage_data[26] = ((entry.fsize >> 16) & 0xFF);
+	zs->stage_data[27] = ((entry.fsize >> 24) & 0xFF);
 
 	// Filename Length
 	zs->stage_data[28] = ((zs->zsf->lfname >>  0) & 0xFF);
 	zs->stage_data[29] = ((zs->zsf->lfname >>  8) & 0xFF);
 
 	// Extra Field Length
-	zs->stage_data[30] = 0x00;
-	zs->stage_data[31] = 0x00;
+	zs->stage_data[30] = ((zs->zsf->lextra >>  0) & 0xFF);
+	zs->stage_data[31] = ((zs->zsf->lextra >>  8) & 0xFF);
 
 	// File Comment Length
 	zs->stage_data[32] = 0x00;
@@ -711,10 +3063,10 @@ void zs_build_cdh(ZS *zs) {
 	zs->stage_data[41] = 0x00;
 
 	// Relative Offset Of LH
-	zs->stage_data[42] = ((zs->zsf->offset >>  0) & 0xFF);
-	zs->stage_data[43] = ((zs->zsf->offset >>  8) & 0xFF);
-	zs->stage_data[44] = ((zs->zsf->offset >> 16) & 0xFF);
-	zs->stage_data[45] = ((zs->zsf->offset >> 24) & 0xFF);
+	zs->stage_data[42] = ((entry.offset >>  0) & 0xFF);
+	zs->stage_data[43] = ((entry.offset >>  8) & 0xFF);
+	zs->stage_data[44] = ((entry.offset >> 16) & 0xFF);
+	zs->stage_data[45] = ((entry.offset >> 24) & 0xFF);
 
 	return;
 }
@@ -740,8 +3092,8 @@ void zs_build_eocd(ZS *zs) {
 	zs->stage_data[ 7] = 0x00;
 
 	// #Entries Of This Disk
-	zs->stage_data[ 8] = ((zs->zsd.nfiles >>  0) & 0xFF);
-	zs->stage_data[ 9] = ((zs->zsd.nfiles >>  8) & 0xFF);
+	zs->stage_data[ 8] = ((zs->zsp->zsd.nfiles >>  0) & 0xFF);
+	zs->stage_data[ 9] = ((zs->zsp->zsd.nfiles >>  8) & 0xFF);
 
 	// #Entries
 	zs->stage_data[10] = zs->stage_data[ 8];
@@ -768,6 +3120,10 @@ void zs_build_eocd(ZS *zs) {
 	return;
 }
 
+size_t zs_get_lfdsize(ZSFile *zsf) {
+	return (zsf->flags & ZS_FLAG_DESCRIPTOR) ? ZS_LENGTH_LFD : 0;
+}
+
 size_t zs_get_cdsize(ZS *zs) {
 	int size = 0;
 	ZSFile *zsf;
@@ -775,11 +3131,17 @@ size_t zs_get_cdsize(ZS *zs) {
 	if(zs == NULL)
 		return 0;
 
-	zsf = zs->zsd.files;
+	if(zs->zsp->compact.enabled == 1)
+		return zs->compact.cdsize;
+
+	if(zs->zsp->layout == 1)
+		return zs->zsp->cdsize;
+
+	zsf = zs->zsp->zsd.files;
 
 	while(zsf != NULL) {
 		size += ZS_LENGTH_CDH;
-		size += zsf->lfname;
+		size += zsf->lfname + zsf->lextra;
 
 		zsf = zsf->next;
 	}
@@ -794,21 +3156,36 @@ size_t zs_get_cdoffset(ZS *zs) {
 	if(zs == NULL)
 		return 0;
 
-	zsf = zs->zsd.files;
+	if(zs->zsp->compact.enabled == 1)
+		return zs->compact.cdoffset;
+
+	if(zs->entries == NULL && zs->zsp->layout == 1)
+		return zs->zsp->cdoffset;
+
+	zsf = zs->zsp->zsd.files;
 
 	while(zsf != NULL) {
-		if(zsf->next == NULL) {
-			offset = zsf->offset;
+		if(zsf->next == NULL)
 			break;
-		}
 
 		zsf = zsf->next;
 	}
 
+	if(zsf == NULL)
+		return 0;
+
+	if(zs->entries != NULL) {
+		offset = zs->entries[zs->zsp->zsd.nfiles - 1].offset;
+		offset += zs->entries[zs->zsp->zsd.nfiles - 1].fsize_compressed;
+	}
+	else {
+		offset = zsf->offset;
+		offset += zsf->fsize_compressed;
+	}
+
 	offset += ZS_LENGTH_LFH;
-	offset += zsf->lfname;
-	offset += zsf->fsize_compressed;
-	offset += ZS_LENGTH_LFD;
+	offset += zsf->lfname + zsf->lextra;
+	offset += zs_get_lfdsize(zsf);
 
 	return offset;
 }
@@ -8,6 +8,66 @@
 #define ZS_LENGTH_CDH		46
 #define ZS_LENGTH_EOCD		22
 
+// Data is copied verbatim from another archive
+#define ZS_COMPRESS_RAW		-1
+
+// Data is the digest manifest of the reader
+#define ZS_COMPRESS_MANIFEST	-2
+
+#define ZS_FLAG_ENCRYPTED	0x01
+#define ZS_FLAG_DESCRIPTOR	0x08	// Bit3 : CRC32, file sizes unknown at this time
+
+#ifdef WITH_AES
+#define ZS_METHOD_AES		99
+#define ZS_LENGTH_AES_EXTRA	11
+#define ZS_LENGTH_AES_HEADER	(ZS_AES_SALT_LENGTH + ZS_AES_VERIFIER_LENGTH)
+
+#define ZS_AES_PHASE_HEADER	0
+#define ZS_AES_PHASE_DATA	1
+#define ZS_AES_PHASE_MAC	2
+#define ZS_AES_PHASE_DONE	3
+#endif
+
+#define ZS_CRC_CHUNK		(4 * 1024 * 1024)
+
+// No ZIP64 records: 16 bit entry count, 32 bit sizes and offsets, the all
+// ones values are left alone since they announce ZIP64
+#define ZS_MAX_ENTRIES		0xFFFE
+#define ZS_MAX_SIZE		0xFFFFFFFEUL
+
+// 1980-01-01 00:00, the earliest MS-DOS date
+#define ZS_DOSTIME_MIN		0x00210000
+
+// Bumped whenever the output for the same plan changes
+#define ZS_FINGERPRINT_VERSION	1
+
+// Seconds between level changes of the adaptive mode
+#define ZS_ADAPT_WINDOW		0.25
+
+// CRC32 computed in chunks on a worker pool
+typedef struct ZSCrcChunk {
+	struct ZSCrc *crc;
+
+	const char *data;
+	size_t size;
+
+	unsigned long value;
+	int changed;
+} ZSCrcChunk;
+
+typedef struct ZSCrc {
+	int nchunks;
+	ZSCrcChunk *chunks;
+
+	// Mapped file and its size, checked before every chunk
+	int fd;
+	size_t size;
+
+	ZSWait wait;
+} ZSCrc;
+
+void zs_prepare_lfh(ZSFile *zsf);
+
 void zs_build_lfh(ZS *zs);
 void zs_build_lfd(ZS *zs);
 void zs_build_cdh(ZS *zs);
@@ -16,17 +76,69 @@ void zs_build_eocd(ZS *zs);
 int zs_write_stagedata(ZS *zs, char *buf, int sbuf, int size);
 int zs_write_filename(ZS *zs, char *buf, int sbuf);
 
+ZSFile *zs_file_new(const char *targetpath, const char *sourcepath, int compression, int level);
+void zs_file_free(ZSFile *zsf);
+int zs_plan_append(ZSPlan *zsp, ZSFile *zsf);
+void zs_plan_fingerprint(ZSFingerprint *fp, ZSFile *zsf);
+unsigned long zs_dostime(time_t t);
+unsigned long zs_dostime_tm(const struct tm *tm);
+
+int zs_write_filedata(ZS *zs, char *buf, int sbuf);
+int zs_write_filedata_staged(ZS *zs, char *buf, int sbuf);
 int zs_write_filedata_none(ZS *zs, char *buf, int sbuf);
+int zs_write_filedata_mmap(ZS *zs, char *buf, int sbuf);
+int zs_write_filedata_raw(ZS *zs, char *buf, int sbuf);
+int zs_write_filedata_replay(ZS *zs, char *buf, int sbuf);
+int zs_write_filedata_small(ZS *zs, char *buf, int sbuf);
+#ifdef WITH_DIGEST
+int zs_write_filedata_manifest(ZS *zs, char *buf, int sbuf);
+#endif
 #ifdef WITH_DEFLATE
 int zs_write_filedata_deflate(ZS *zs, char *buf, int sbuf);
 #endif
 #ifdef WITH_BZIP2
 int zs_write_filedata_bzip2(ZS *zs, char *buf, int sbuf);
+int zs_write_filedata_pbzip2(ZS *zs, char *buf, int sbuf);
+int zs_pbzip2_entry(ZS *zs);
 #endif
+#ifdef WITH_AES
+int zs_write_filedata_aes(ZS *zs, char *buf, int sbuf);
+#endif
+
+int zs_range_copy(char *buf, int sbuf, const char *data, size_t size, size_t pos);
+int zs_range_name(char *buf, int sbuf, ZSFile *zsf, size_t pos);
+int zs_range_pread(char *buf, int sbuf, const char *path, size_t size, size_t pos);
+int zs_crc_file(ZSPool *pool, const char *path, unsigned long *crc, size_t *size);
+
+ZSCrc *zs_crc_parallel(ZSPool *pool, int fd, const char *data, size_t size);
+void zs_crc_chunk(void *arg);
+int zs_crc_wait(ZSCrc *crc, unsigned long *value);
+int zs_map_check(int fd, size_t size);
+
+int zs_map_open(ZS *zs);
+void zs_map_close(ZS *zs);
 
 size_t zs_get_cdoffset(ZS *zs);
+size_t zs_get_lfdsize(ZSFile *zsf);
 size_t zs_get_cdsize(ZS *zs);
 
+int zs_codec_acquire(ZS *zs);
+#ifdef WITH_DEFLATE
+void zs_adapt(ZS *zs);
+#endif
+void zs_codec_release(ZS *zs);
+int zs_dedup_begin(ZS *zs);
+void zs_dedup_capture(ZS *zs, const char *buf, int len);
+void zs_dedup_end(ZS *zs);
+void zs_digest_begin(ZS *zs);
+void zs_digest_data(ZS *zs, const void *data, size_t len);
+void zs_digest_end(ZS *zs);
+int zs_small_load(ZS *zs);
+int zs_small_begin(ZS *zs);
+ZSFile *zs_entry_first(ZS *zs);
+ZSFile *zs_entry_next(ZS *zs);
+ZSFile *zs_entry_load(ZS *zs);
+int zs_publish(ZS *zs);
 void zs_stager(ZS *zs);
 
 #endif
@@ -3,14 +3,29 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #ifdef WITH_DEFLATE
 	#include <zlib.h>
 #endif
 #ifdef WITH_BZIP2
 	#include <bzlib.h>
+	#include "pbzip2.h"
+#endif
+#ifdef WITH_AES
+	#include "aes.h"
+#endif
+#ifdef WITH_DIGEST
+	#include "digest.h"
 #endif
 
+#include "pool.h"
+#include "codec.h"
+#include "store.h"
+#include "dedup.h"
+#include "fingerprint.h"
+
 #define ZS_STAGE_LENGTH_MAX		46
 
 #define ZS_COMPRESS_NONE		0
@@ -30,7 +45,12 @@
 #define ZS_COMPRESS_BUFFER_DEFLATE	4096
 #define ZS_COMPRESS_BUFFER_BZIP2	4096
 
+#define ZS_OUTPUT_BUFFER		262144
+
+#define ZS_EXTRA_LENGTH_MAX		16
+
 #define ZSE_OK				0
+#define ZSE_AGAIN			-2	// codec memory budget exhausted, retry later
 
 typedef struct ZSFile {
 	char *fpath;
@@ -39,11 +59,10 @@ typedef struct ZSFile {
 	size_t lfname;
 
 	time_t ftime;
+	unsigned long dostime;
 	size_t fsize;
 	size_t fsize_compressed;
 
-	int completed;
-
 	unsigned long crc32;
 
 	size_t offset;
@@ -53,6 +72,37 @@ typedef struct ZSFile {
 
 	int version;
 
+	// Method and general purpose flags as written to the headers
+	int method;
+	int flags;
+
+	// Offset of the data in the source archive (raw copied entries)
+	size_t raw_offset;
+
+	// Extra field
+	char extra[ZS_EXTRA_LENGTH_MAX];
+	size_t lextra;
+
+#ifdef WITH_AES
+	// Encryption password
+	ZSAesSecret *aes;
+#endif
+
+	// crc32, fsize, fsize_compressed and offset are known
+	int cached;
+
+	// offset is known. Copied entries come cached but not yet placed. Set
+	// once under the plan lock, the offset doesn't change after.
+	int placed;
+
+	// Source file and group of identical entries (0: none)
+	dev_t dev;
+	ino_t ino;
+	int dedup;
+
+	// Precomputed local file header
+	char lfh[ZS_STAGE_LENGTH_MAX];
+
 	struct ZSFile *prev;
 	struct ZSFile *next;
 } ZSFile;
@@ -60,17 +110,123 @@ typedef struct ZSFile {
 typedef struct {
 	int nfiles;
 	ZSFile *files;
+	ZSFile *last;
 } ZSDirectory;
 
+// Directory values of an entry as produced by one cursor
+typedef struct {
+	unsigned long crc32;
+	size_t fsize;
+	size_t fsize_compressed;
+	size_t offset;
+} ZSEntry;
+
+// Immutable (once finalized) and reference counted archive plan,
+// shareable by any number of concurrent readers
+typedef struct ZSPlan {
+	// References
+	int refs;
+
+	// Finalized (-1: finalizing failed)
+	int finalized;
+
+	// Directory
+	ZSDirectory zsd;
+
+	// Layout (offsets of all entries and the central directory) is known
+	int layout;
+	size_t size;
+	size_t cdoffset;
+	size_t cdsize;
+
+	// Worker pool for parallel work (not owned)
+	ZSPool *pool;
+
+	// Read stored entries from a memory mapping of the file
+	int mmap;
+
+	// Shared compressor contexts (not owned)
+	ZSCodecPool *codecs;
+
+	// Has encrypted entries
+	int encrypted;
+
+	// Entries as compact records instead of ZSFile, see zs_plan_set_compact()
+	struct {
+		int enabled;
+		char *basedir;
+
+		ZSStore store;
+		ZSStoreNames names;
+	} compact;
+
+	// Identical entries, see zs_plan_set_dedup()
+	ZSDedup dedup;
+
+	// Files up to this size are compressed in one go, see zs_plan_set_small()
+	size_t small;
+
+#ifdef WITH_BZIP2
+	// bzip2 blocks in flight per cursor on the pool, see zs_plan_set_pbzip2()
+	int pbzip2;
+#endif
+
+	// Time of all entries (0: their modification times), see
+	// zs_plan_set_time()
+	unsigned long dostime;
+
+	// Of the entries added so far, see zs_fingerprint()
+	ZSFingerprint fingerprint;
+	time_t newest;
+
+#ifdef WITH_DIGEST
+	// Digests of the entries and the name of the manifest member, see
+	// zs_plan_set_digests()
+	struct {
+		int digests;
+		char *manifest;
+	} digest;
+#endif
+
+	// Entries and their central directory offsets, in archive order
+	ZSFile **index;
+	size_t *cdindex;
+
+	// Protects refs, finalized and the cached entry values
+	pthread_mutex_t lock;
+} ZSPlan;
+
 typedef enum {NONE = 0, LF_HEADER, LF_NAME, LF_DATA, LF_DESCRIPTOR, CD_HEADER, CD_NAME, EOCD, FIN, ERROR} stages;
 
 typedef struct ZS {
+	// Plan
+	ZSPlan *zsp;
+
 	// Current file
 	ZSFile *zsf;
 
+	// Current file state
+	unsigned long crc32;
+	size_t fsize;
+	size_t fsize_compressed;
+	int completed;
+
+	// crc32 is final already, the stager doesn't finish it
+	int crc_final;
+
 	// Current file pointer
 	FILE *fp;
 
+	// Current file mapping (stored entries), fd stays open to notice a
+	// source that shrinks
+	struct {
+		char *data;
+		size_t size;
+		int fd;
+		int inline_crc;
+		struct ZSCrc *crc;
+	} map;
+
 	// Stage
 	stages stage;
 
@@ -80,18 +236,110 @@ typedef struct ZS {
 	// Stage position
 	size_t stage_pos;
 
-	// Finalized
-	int finalized;
-
-	// Directory
-	ZSDirectory zsd;
-
 	// File data writer
 	int (*write_filedata)(struct ZS *, char *, int);
 
+	// Compressor context of the current file
+	ZSCodec *codec;
+	int again;
+
+	// Context of the previous file, kept for the next one without a pool
+	ZSCodec *spare;
+
+	// Adaptive deflate level, see zs_set_adaptive()
+	struct {
+		int enabled;
+		size_t rate;
+		int cpu;
+
+		int level;
+
+		// Current window
+		struct timespec start;
+		double busy;
+		size_t in;
+	} adapt;
+
+	// Directory values of this cursor, used instead of the ones cached in
+	// the plan if the output differs from other readers (adaptive level)
+	ZSEntry *entries;
+	int entry;
+
+	// Compact plans: the current entry is decoded from the records of the
+	// plan, the values of finished entries go to a store of the cursor and
+	// are read back for the central directory
+	struct {
+		int init;
+
+		ZSStoreReader reader;
+		ZSStoreNames names;
+		ZSFile file;
+
+		ZSStore cd;
+		ZSStoreReader cdreader;
+		ZSEntry entry;
+
+		size_t cdsize;
+		size_t cdoffset;
+	} compact;
+
+	// Output of the first entry of every group of identical entries,
+	// replayed for the others
+	struct {
+		ZSDedupSlot *slots;
+		ZSStore store;
+		int init;
+
+		ZSDedupSlot *capture;
+		ZSDedupSlot *replay;
+	} dedup;
+
+	// Current small file, compressed before its local header is built
+	struct {
+		int ready;
+
+		char *in;
+		size_t sin;
+		char *out;
+		size_t sout;
+
+		const char *data;
+		size_t len;
+
+		unsigned long crc32;
+		size_t fsize;
+	} small;
+
+	// Output staging buffer for the file data writer, such that the
+	// codecs run on large chunks regardless of the size of the buffer
+	// passed to zs_read()
+	struct {
+		char *data;
+		int size;	// 0: ZS_OUTPUT_BUFFER, -1: unbuffered
+		int pos;
+		int len;
+		int completed;
+	} out;
+
+#ifdef WITH_DIGEST
+	struct {
+		ZSDigestCtx ctx;
+		int init;
+		int active;
+
+		// Last completed entry
+		ZSDigest digest;
+
+		void (*fn)(void *, const char *, const ZSDigest *);
+		void *arg;
+
+		// Contents of the manifest member
+		ZSStore manifest;
+	} digest;
+#endif
+
 #ifdef WITH_DEFLATE
 	struct {
-		z_stream strm;
 		int init;
 		int avail_in;
 		int flush;
@@ -100,20 +348,71 @@ typedef struct ZS {
 	} deflate;
 #endif
 
+#ifdef WITH_AES
+	struct {
+		ZSAesKey key;
+		ZSAes ctx;
+		int init;
+		int phase;
+		size_t pos;
+		unsigned char mac[ZS_AES_MAC_LENGTH];
+		int (*write_filedata)(struct ZS *, char *, int);
+	} aes;
+#endif
+
 #ifdef WITH_BZIP2
 	struct {
-		bz_stream strm;
 		int init;
 		int avail_in;
 		int flush;
 		int level;
+		int pos;
 		char in[ZS_COMPRESS_BUFFER_BZIP2];
+
+		// Blocks compressed on the pool
+		ZSPbzip2 parallel;
 	} bzip2;
 #endif
 } ZS;
 
+ZSPlan *zs_plan_new(void);
+int zs_plan_add_file(ZSPlan *zsp, const char *targetpath, const char *sourcepath, int compression, int level);
+#ifdef WITH_AES
+int zs_plan_add_file_aes(ZSPlan *zsp, const char *targetpath, const char *sourcepath, int compression, int level, const char *password);
+#endif
+int zs_plan_add_from_zip(ZSPlan *zsp, const char *archivepath, const char *pattern);
+int zs_plan_set_pool(ZSPlan *zsp, ZSPool *pool);
+int zs_plan_set_mmap(ZSPlan *zsp, int enable);
+int zs_plan_set_codecs(ZSPlan *zsp, ZSCodecPool *codecs);
+int zs_plan_set_compact(ZSPlan *zsp, const char *basedir, int spill);
+int zs_plan_set_dedup(ZSPlan *zsp, int mode, size_t budget);
+int zs_plan_set_small(ZSPlan *zsp, size_t size);
+int zs_plan_set_time(ZSPlan *zsp, time_t t);
+#ifdef WITH_BZIP2
+int zs_plan_set_pbzip2(ZSPlan *zsp, int blocks);
+#endif
+#ifdef WITH_DIGEST
+int zs_plan_set_digests(ZSPlan *zsp, int digests, const char *manifest);
+#endif
+int zs_plan_finalize(ZSPlan *zsp);
+int zs_fingerprint(ZSPlan *zsp, char *buf, size_t sbuf);
+int zs_plan_layout(ZSPlan *zsp);
+int zs_read_range(ZSPlan *zsp, size_t offset, int len, char *buf);
+ZSPlan *zs_plan_ref(ZSPlan *zsp);
+void zs_plan_unref(ZSPlan *zsp);
+
 void zs_init(ZS *zs);
+int zs_open(ZS *zs, ZSPlan *zsp);
 int zs_add_file(ZS *zs, const char *targetpath, const char *sourcepath, int compression, int level);
+#ifdef WITH_AES
+int zs_add_file_aes(ZS *zs, const char *targetpath, const char *sourcepath, int compression, int level, const char *password);
+#endif
+int zs_add_from_zip(ZS *zs, const char *archivepath, const char *pattern);
+int zs_set_buffer(ZS *zs, int size);
+int zs_set_adaptive(ZS *zs, size_t rate, int cpu);
+#ifdef WITH_DIGEST
+int zs_set_digest_callback(ZS *zs, void (*fn)(void *arg, const char *name, const ZSDigest *digest), void *arg);
+#endif
 int zs_read(ZS *zs, char *buf, int sbuf);
 void zs_free(ZS *zs);
 
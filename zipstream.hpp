@@ -0,0 +1,353 @@
+#ifndef _ZIPSTREAM_HPP_
+#define _ZIPSTREAM_HPP_
+
+// C++20 layer over the C API, header only. The library itself is still built
+// as C and linked as before.
+
+#include <coroutine>
+#include <cstddef>
+#include <ctime>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+extern "C" {
+#include "zipstream.h"
+}
+
+namespace zipstream {
+
+class error : public std::runtime_error {
+public:
+	explicit error(const std::string &what) : std::runtime_error("zipstream: " + what) {}
+};
+
+// Minimal std::generator (C++23) replacement, good for one range-for
+template<typename T>
+class generator {
+public:
+	struct promise_type {
+		T value;
+		std::exception_ptr exception;
+
+		generator get_return_object() { return generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(T v) noexcept { value = std::move(v); return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	class iterator {
+	public:
+		explicit iterator(std::coroutine_handle<promise_type> h = nullptr) : h(h) {}
+
+		iterator &operator++() {
+			h.resume();
+			check();
+			return *this;
+		}
+
+		const T &operator*() const { return h.promise().value; }
+		bool operator==(std::default_sentinel_t) const { return h == nullptr || h.done(); }
+
+		void check() {
+			if(h.done() && h.promise().exception)
+				std::rethrow_exception(h.promise().exception);
+		}
+
+	private:
+		std::coroutine_handle<promise_type> h;
+	};
+
+	generator(generator &&other) noexcept : h(std::exchange(other.h, nullptr)) {}
+	generator(const generator &) = delete;
+	generator &operator=(const generator &) = delete;
+
+	~generator() {
+		if(h)
+			h.destroy();
+	}
+
+	iterator begin() {
+		iterator it(h);
+
+		h.resume();
+		it.check();
+
+		return it;
+	}
+
+	std::default_sentinel_t end() { return {}; }
+
+private:
+	explicit generator(std::coroutine_handle<promise_type> h) : h(h) {}
+
+	std::coroutine_handle<promise_type> h;
+};
+
+// Shared, immutable once finalized archive plan (ZSPlan). Copies share it.
+class plan {
+public:
+	plan() : zsp(zs_plan_new()) {
+		if(zsp == nullptr)
+			throw std::bad_alloc();
+	}
+
+	plan(const plan &other) : zsp(zs_plan_ref(other.zsp)) {}
+	plan(plan &&other) noexcept : zsp(std::exchange(other.zsp, nullptr)) {}
+
+	plan &operator=(plan other) noexcept {
+		std::swap(zsp, other.zsp);
+		return *this;
+	}
+
+	~plan() {
+		if(zsp != nullptr)
+			zs_plan_unref(zsp);
+	}
+
+	void add_file(const char *target, const char *source, int compression = ZS_COMPRESS_NONE, int level = ZS_COMPRESS_LEVEL_DEFAULT) {
+		if(zs_plan_add_file(zsp, target, source, compression, level) != 0)
+			throw error(std::string("can't add ") + source);
+	}
+
+#ifdef WITH_AES
+	void add_file(const char *target, const char *source, int compression, int level, const char *password) {
+		if(zs_plan_add_file_aes(zsp, target, source, compression, level, password) != 0)
+			throw error(std::string("can't add ") + source);
+	}
+#endif
+
+	int add_from_zip(const char *archive, const char *pattern = nullptr) {
+		int n = zs_plan_add_from_zip(zsp, archive, pattern);
+
+		if(n < 0)
+			throw error(std::string("can't read ") + archive);
+
+		return n;
+	}
+
+	void set_pool(ZSPool *pool) { check(zs_plan_set_pool(zsp, pool), "set_pool"); }
+	void set_mmap(bool enable) { check(zs_plan_set_mmap(zsp, enable ? 1 : 0), "set_mmap"); }
+	void set_codecs(ZSCodecPool *codecs) { check(zs_plan_set_codecs(zsp, codecs), "set_codecs"); }
+	void set_dedup(int mode, std::size_t budget = 0) { check(zs_plan_set_dedup(zsp, mode, budget), "set_dedup"); }
+	void set_small(std::size_t size) { check(zs_plan_set_small(zsp, size), "set_small"); }
+	void set_time(std::time_t t) { check(zs_plan_set_time(zsp, t), "set_time"); }
+#ifdef WITH_BZIP2
+	void set_pbzip2(int blocks) { check(zs_plan_set_pbzip2(zsp, blocks), "set_pbzip2"); }
+#endif
+#ifdef WITH_DIGEST
+	void set_digests(int digests, const char *manifest = nullptr) { check(zs_plan_set_digests(zsp, digests, manifest), "set_digests"); }
+#endif
+
+	void finalize() { check(zs_plan_finalize(zsp), "finalize"); }
+
+	// Strong ETag, finalizes the plan. Not for streams with set_adaptive().
+	std::string fingerprint() {
+		char buf[2 * ZS_FINGERPRINT_LENGTH + 1];
+
+		check(zs_fingerprint(zsp, buf, sizeof(buf)), "fingerprint");
+		return buf;
+	}
+
+	// Size of the archive, compressed entries must have been read by a stream.
+	// read_range() still serves stored or copied entries only.
+	std::size_t layout() {
+		check(zs_plan_layout(zsp), "layout");
+		return zsp->size;
+	}
+
+	std::size_t read_range(std::size_t offset, std::span<std::byte> buf) const {
+		int n = zs_read_range(zsp, offset, static_cast<int>(buf.size()), reinterpret_cast<char *>(buf.data()));
+
+		if(n < 0)
+			throw error("read_range");
+
+		return static_cast<std::size_t>(n);
+	}
+
+	ZSPlan *get() const noexcept { return zsp; }
+
+private:
+	static void check(int rv, const char *what) {
+		if(rv != 0)
+			throw error(what);
+	}
+
+	ZSPlan *zsp;
+};
+
+// Runs jobs on a ZSPool (pool.c)
+class pool_executor {
+public:
+	explicit pool_executor(ZSPool *pool) : pool(pool) {}
+
+	void operator()(std::function<void()> fn) const {
+		auto job = new std::function<void()>(std::move(fn));
+
+		if(zs_pool_submit(pool, run, job) != 0) {
+			delete job;
+			throw error("pool_submit");
+		}
+	}
+
+private:
+	static void run(void *arg) {
+		std::unique_ptr<std::function<void()>> job(static_cast<std::function<void()> *>(arg));
+
+		(*job)();
+	}
+
+	ZSPool *pool;
+};
+
+// One reader of a plan (ZS). The ZS is kept on the heap, the codecs point
+// into it. Not to be used from more than one thread at a time.
+class stream {
+public:
+	explicit stream(const plan &p) : zs(open(p)) {}
+
+	stream(stream &&) noexcept = default;
+	stream &operator=(stream &&) noexcept = default;
+
+	void set_buffer(int size) {
+		if(zs_set_buffer(zs.get(), size) != 0)
+			throw error("set_buffer");
+	}
+
+	void set_adaptive(std::size_t rate, int cpu) {
+		if(zs_set_adaptive(zs.get(), rate, cpu) != 0)
+			throw error("set_adaptive");
+	}
+
+#ifdef WITH_DIGEST
+	void set_digest_callback(void (*fn)(void *, const char *, const ZSDigest *), void *arg) {
+		if(zs_set_digest_callback(zs.get(), fn, arg) != 0)
+			throw error("set_digest_callback");
+	}
+#endif
+
+	// Fills buf as far as possible. Returns 0 at the end of the archive, or
+	// if the codec budget is exhausted (ZSE_AGAIN), see eof().
+	std::size_t read(std::span<std::byte> buf) {
+		int n = zs_read(zs.get(), reinterpret_cast<char *>(buf.data()), static_cast<int>(buf.size()));
+
+		if(n == ZSE_AGAIN)
+			return 0;
+
+		if(n < 0)
+			throw error("read");
+
+		return static_cast<std::size_t>(n);
+	}
+
+	bool eof() const noexcept { return zs->stage == FIN; }
+
+	// Whether a read of n bytes is served from the output staging buffer,
+	// i.e. without touching the source files or the codec
+	bool buffered(std::size_t n) const noexcept {
+		return zs->stage == LF_DATA && zs->out.data != nullptr && static_cast<std::size_t>(zs->out.len - zs->out.pos) >= n;
+	}
+
+	// Chunks of the archive, each a view into buf that is valid until the
+	// next one. An empty chunk means the codec budget is exhausted.
+	generator<std::span<const std::byte>> chunks(std::span<std::byte> buf) {
+		std::size_t n;
+
+		while(!eof()) {
+			n = read(buf);
+
+			if(n == 0 && eof())
+				break;
+
+			co_yield std::span<const std::byte>(buf.data(), n);
+		}
+	}
+
+	// co_await s.async_read(buf, executor): the read runs on the executor
+	// (any callable taking a std::function<void()>, e.g. a wrapper around
+	// asio::post()) and the coroutine is resumed there. Reads served from the
+	// staging buffer don't suspend.
+	template<typename Executor>
+	class read_awaitable {
+	public:
+		read_awaitable(stream &s, std::span<std::byte> buf, Executor ex) : s(s), buf(buf), ex(std::move(ex)) {}
+
+		bool await_ready() {
+			if(!s.buffered(buf.size()))
+				return false;
+
+			complete();
+
+			return true;
+		}
+
+		void await_suspend(std::coroutine_handle<> h) {
+			ex([this, h]() {
+				complete();
+				h.resume();
+			});
+		}
+
+		std::size_t await_resume() {
+			if(exception)
+				std::rethrow_exception(exception);
+
+			return result;
+		}
+
+	private:
+		void complete() {
+			try {
+				result = s.read(buf);
+			}
+			catch(...) {
+				exception = std::current_exception();
+			}
+		}
+
+		stream &s;
+		std::span<std::byte> buf;
+		Executor ex;
+
+		std::size_t result = 0;
+		std::exception_ptr exception;
+	};
+
+	template<typename Executor>
+	read_awaitable<Executor> async_read(std::span<std::byte> buf, Executor ex) {
+		return read_awaitable<Executor>(*this, buf, std::move(ex));
+	}
+
+	ZS *get() const noexcept { return zs.get(); }
+
+private:
+	// zs_free() before the ZS itself goes, also on move assignment
+	struct zs_delete {
+		void operator()(ZS *z) const noexcept {
+			zs_free(z);
+			delete z;
+		}
+	};
+
+	static ZS *open(const plan &p) {
+		std::unique_ptr<ZS> z(new ZS);
+
+		if(zs_open(z.get(), p.get()) != 0)
+			throw error("open");
+
+		return z.release();
+	}
+
+	std::unique_ptr<ZS, zs_delete> zs;
+};
+
+}
+
+#endif